@@ -24,6 +24,7 @@
 #include <map>
 #include <csignal>
 #include <cassert>
+#include <cstring>
 
 #include <boost/asio.hpp>
 #include <boost/array.hpp>
@@ -31,26 +32,77 @@
 
 #include "matplotlibcpp.h"
 
-#define PACKET_DATA_LENGTH 256
-#define PACKET_CONVERSION_LENGTH PACKET_DATA_LENGTH*3/4
+#define PACKET_HEADER_LENGTH 3
+#define PACKET_DATA_LENGTH 1400 /* asked for unless given, fits a 1500 byte MTU */
+#define PACKET_DATA_LENGTH_MAX 8900
+
+#define PACKET_TYPE_CONNECT_ACK 3
+#define PACKET_TYPE_DATA_V2 4
+#define PACKET_TYPE_NACK 5
+#define PACKET_TYPE_DATA_RESEND 6
+#define CONNECT_ACK_LENGTH 3
+#define CONNECT_ACK_LENGTH_VERSION 4
+
+// header version 2, see daqsrv-udp.cpp
+#define HEADER_VERSION 2
+#define PACKET_V2_OFFSET_FLAGS 1
+#define PACKET_V2_OFFSET_COUNTER 2
+#define PACKET_V2_OFFSET_RATE 4
+#define PACKET_V2_OFFSET_INDEX 8
+#define PACKET_V2_OFFSET_TIMESTAMP 16
+#define PACKET_V2_HEADER_LENGTH 24
+
+#define PACKET_FLAG_DEVICE_LOSS 0x1
+#define PACKET_FLAG_SERVER_LOSS 0x2
+#define PACKET_FLAG_DEVICE_DROP 0x4
+
+#define BYTES_PER_SAMPLE 2
+
+// missing datagrams are asked for again with a NACK, up to this many at once
+#define NACK_GAP_MAX 4096
 
 namespace {
 	std::shared_ptr<boost::asio::ip::udp::socket> socket_ptr = nullptr;
 	std::shared_ptr<std::vector<uint8_t>> data_ptr = nullptr;
-	std::shared_ptr<std::map<uint64_t, uint16_t>> invalid_ptr = nullptr;
+	std::shared_ptr<std::map<uint64_t, uint64_t>> invalid_ptr = nullptr; // data offset, samples lost there
 	std::shared_ptr<boost::asio::io_context> iocontext_ptr = nullptr;
-	std::shared_ptr<boost::array<uint8_t, 259>> recvbuf_ptr = nullptr;
+	std::shared_ptr<std::vector<uint8_t>> recvbuf_ptr = nullptr;
+	std::shared_ptr<size_t> payload_size_ptr;
+	std::shared_ptr<uint8_t> header_version_ptr;
+	std::shared_ptr<std::map<uint64_t, std::vector<uint8_t>>> chunks_ptr; // header version 2, by sample index
+	std::shared_ptr<bool> nack_ptr;
+	std::shared_ptr<uint64_t> resent_ptr;
 	std::shared_ptr<bool> run_ptr;
 	std::shared_ptr<double> real_sample_rate_ptr;
 }
 
+/*
+ * With header version 2 the samples are kept by index, resent datagrams
+ * fill the holes they left. Whatever is still missing becomes a gap.
+ */
+void flattenChunks()
+{
+	if (chunks_ptr->empty()) {
+		return;
+	}
+
+	uint64_t next_index = std::begin(*chunks_ptr)->first;
+	for (auto &chunk : *chunks_ptr) {
+		if (chunk.first > next_index) {
+			invalid_ptr->emplace(std::make_pair(data_ptr->size(), chunk.first - next_index));
+		}
+		data_ptr->insert(std::end(*data_ptr), std::begin(chunk.second), std::end(chunk.second));
+		next_index = std::max(next_index, chunk.first + chunk.second.size() / BYTES_PER_SAMPLE);
+	}
+	std::cout << *resent_ptr << " packets were resent." << std::endl;
+}
+
 void showData()
 {
 	std::vector<uint16_t> samples;
 	std::vector<double> time_samples;
 
-	std::array<uint16_t, PACKET_CONVERSION_LENGTH> null_samples;
-	null_samples.fill(0);
+	flattenChunks();
 
 	double const sample_time = 1.0/(*real_sample_rate_ptr);
 	uint64_t cntr = 0;
@@ -73,16 +125,13 @@ void showData()
 			cntr += 2;
 		}
 
-		for (int i = 0; i < k.second; i++)
-		{
-			samples.insert(std::end(samples), std::begin(null_samples), std::end(null_samples));
-		}
+		samples.insert(std::end(samples), k.second, 0);
 
-		for (uint64_t i = 0; i < k.second * PACKET_CONVERSION_LENGTH; i++)
+		for (uint64_t i = 0; i < k.second; i++)
 		{
 			time_samples.insert(std::end(time_samples), static_cast<double>(cntr + i) * sample_time);
 		}
-		cntr += k.second * PACKET_CONVERSION_LENGTH;
+		cntr += k.second;
 			
 		//start = stop;
 	}
@@ -112,20 +161,102 @@ void showData()
 	matplotlibcpp::detail::_interpreter::kill();
 }
 
-void recvData(uint16_t packet_cntr)
+template<typename T>
+T packetField(size_t offset)
+{
+	T value;
+	std::memcpy(&value, recvbuf_ptr->data() + offset, sizeof(value));
+	return value;
+}
+
+uint64_t storeChunkV2(std::size_t bytes_transferred)
+{
+	uint64_t recv_index = packetField<uint64_t>(PACKET_V2_OFFSET_INDEX);
+	chunks_ptr->emplace(std::make_pair(recv_index, std::vector<uint8_t>(
+		std::begin(*recvbuf_ptr) + PACKET_V2_HEADER_LENGTH, std::begin(*recvbuf_ptr) + bytes_transferred)));
+	return recv_index + (bytes_transferred - PACKET_V2_HEADER_LENGTH) / BYTES_PER_SAMPLE;
+}
+
+/*
+ * Header version 2 says where the samples of a datagram belong, so lost
+ * samples are counted exactly however long the outage was. sample_index is
+ * the one the next datagram should start at.
+ */
+uint64_t placeSamplesV2(uint64_t sample_index, std::size_t bytes_transferred)
+{
+	uint8_t flags = packetField<uint8_t>(PACKET_V2_OFFSET_FLAGS);
+	uint64_t recv_index = packetField<uint64_t>(PACKET_V2_OFFSET_INDEX);
+
+	if (sample_index == 0 && chunks_ptr->empty()) {
+		uint64_t timestamp_ns = packetField<uint64_t>(PACKET_V2_OFFSET_TIMESTAMP);
+		std::cout << "First sample " << recv_index << " captured at " << timestamp_ns << " ns, "
+			<< packetField<uint32_t>(PACKET_V2_OFFSET_RATE) << " Hz." << std::endl;
+	}
+
+	if (flags & PACKET_FLAG_DEVICE_LOSS) {
+		std::cout << "Before sample " << recv_index << " the driver skipped samples." << std::endl;
+	}
+	if (flags & PACKET_FLAG_SERVER_LOSS) {
+		std::cout << "Before sample " << recv_index << " the server had no room for samples." << std::endl;
+	}
+	if (flags & PACKET_FLAG_DEVICE_DROP) {
+		std::cout << "Before sample " << recv_index << " the FPGA overwrote samples, the timestamps counted them." << std::endl;
+	}
+
+	return storeChunkV2(bytes_transferred);
+}
+
+/*
+ * Ask the server for count datagrams from counter first on again.
+ */
+void sendNack(uint16_t first, uint16_t count)
+{
+	auto nack = std::make_shared<std::array<uint8_t, 6>>();
+	(*nack)[0] = PACKET_TYPE_NACK;
+	(*nack)[1] = 1;
+	std::memcpy(nack->data() + 2, &first, sizeof(first));
+	std::memcpy(nack->data() + 4, &count, sizeof(count));
+
+	socket_ptr->async_send(boost::asio::buffer(*nack), 0,
+		[nack](const boost::system::error_code &err, std::size_t)
+		{
+			if (err.failed()) {
+				std::cout << "Error occured when sending a NACK: " << err.to_string() << std::endl;
+			}
+		});
+}
+
+void recvData(uint16_t packet_cntr, uint64_t sample_index)
 {
 	try {
 		auto timer = std::make_shared<boost::asio::deadline_timer>(*iocontext_ptr);
 
-		auto recv_cpltn_hndlr = std::make_shared<std::function<void(void)>>(
-			[packet_cntr, timer]()
+		auto recv_cpltn_hndlr = std::make_shared<std::function<void(std::size_t)>>(
+			[packet_cntr, sample_index, timer](std::size_t bytes_transferred)
 			{
 				timer->cancel();
 				uint8_t packet_type = recvbuf_ptr->at(0);
     			uint16_t recv_packet_cntr = (recvbuf_ptr->at(2) << 8) | recvbuf_ptr->at(1);
+    			if (*header_version_ptr >= 2) {
+    				recv_packet_cntr = packetField<uint16_t>(PACKET_V2_OFFSET_COUNTER);
+    			}
 
     			uint16_t new_packet_cntr = 0;
-    			if (packet_cntr != recv_packet_cntr) {
+    			uint64_t new_sample_index = 0;
+    			if (*header_version_ptr >= 2 && packet_type == PACKET_TYPE_DATA_RESEND) {
+    				// out of band, the stream goes on where it was
+    				storeChunkV2(bytes_transferred);
+    				(*resent_ptr)++;
+    				new_packet_cntr = packet_cntr;
+    				new_sample_index = sample_index;
+    			} else if (*header_version_ptr >= 2) {
+    				uint16_t missing = recv_packet_cntr - packet_cntr;
+    				if (*nack_ptr && !chunks_ptr->empty() && missing != 0 && missing <= NACK_GAP_MAX) {
+    					sendNack(packet_cntr, missing);
+    				}
+    				new_sample_index = placeSamplesV2(sample_index, bytes_transferred);
+    				new_packet_cntr = recv_packet_cntr + 1;
+    			} else if (packet_cntr != recv_packet_cntr) {
 
     				uint16_t packet_diff = 0;
     				if (packet_cntr > recv_packet_cntr) {
@@ -134,7 +265,7 @@ void recvData(uint16_t packet_cntr)
     				} else {
     					packet_diff = recv_packet_cntr - packet_cntr;
     				}
-    				invalid_ptr->emplace(std::make_pair(data_ptr->size(), packet_diff));
+    				invalid_ptr->emplace(std::make_pair(data_ptr->size(), packet_diff * (*payload_size_ptr / BYTES_PER_SAMPLE)));
 
     				if (recv_packet_cntr != 0xffff) {
 	    				new_packet_cntr = recv_packet_cntr + 1;
@@ -143,13 +274,15 @@ void recvData(uint16_t packet_cntr)
     				new_packet_cntr = packet_cntr + 1;
     			}
 
-    			data_ptr->insert(std::end(*data_ptr), std::begin(*recvbuf_ptr) + 3, std::end(*recvbuf_ptr));
+    			if (*header_version_ptr < 2) {
+    				data_ptr->insert(std::end(*data_ptr), std::begin(*recvbuf_ptr) + PACKET_HEADER_LENGTH, std::end(*recvbuf_ptr));
+    			}
 
     			if (*run_ptr) {
 					boost::asio::post(*iocontext_ptr,
-						[new_packet_cntr]()
+						[new_packet_cntr, new_sample_index]()
 						{
-							recvData(new_packet_cntr);
+							recvData(new_packet_cntr, new_sample_index);
 						});
 				} else {
 			    	boost::asio::post(*iocontext_ptr,
@@ -182,13 +315,15 @@ void recvData(uint16_t packet_cntr)
 					return;
 				}
 
-				if (bytes_transferred != 259) {
+				// with header version 2 the datagram before a loss is short
+				if (bytes_transferred != recvbuf_ptr->size()
+					&& (*header_version_ptr < 2 || bytes_transferred <= PACKET_V2_HEADER_LENGTH)) {
 					std::cout << "Didn't receive full packet: " << bytes_transferred << std::endl;
 					return;
 				}
 
 		        if (recv_cpltn_hndlr != nullptr) {
-		        	(*recv_cpltn_hndlr)();
+		        	(*recv_cpltn_hndlr)(bytes_transferred);
 		        } else {
 		        	std::cout << "Read callback destroyed." << std::endl;
 		        }
@@ -217,6 +352,65 @@ void recvData(uint16_t packet_cntr)
 	}
 }
 
+/*
+ * The server answers a connect packet with a payload size with the size it
+ * settled on and, if it knows about them, the header version, data packets
+ * follow.
+ */
+void recvConnectAck()
+{
+	try {
+		auto timer = std::make_shared<boost::asio::deadline_timer>(*iocontext_ptr);
+
+		socket_ptr->async_receive(boost::asio::buffer(*recvbuf_ptr), 0,
+			[timer](const boost::system::error_code &err, std::size_t bytes_transferred)
+			{
+				timer->cancel();
+				if (err.failed()) {
+					if (err.value() != ECANCELED) {
+						std::cout << "Error occured when reading from socket: " << err.to_string() << std::endl;
+					}
+					return;
+				}
+
+				if ((bytes_transferred != CONNECT_ACK_LENGTH && bytes_transferred != CONNECT_ACK_LENGTH_VERSION)
+					|| recvbuf_ptr->at(0) != PACKET_TYPE_CONNECT_ACK) {
+					std::cout << "Server didn't confirm the payload size." << std::endl;
+					socket_ptr->close();
+					return;
+				}
+
+				*payload_size_ptr = (recvbuf_ptr->at(2) << 8) | recvbuf_ptr->at(1);
+				*header_version_ptr = bytes_transferred == CONNECT_ACK_LENGTH_VERSION ? recvbuf_ptr->at(3) : 1;
+				std::cout << "Receiving " << *payload_size_ptr << " bytes per packet, header version "
+					<< static_cast<uint32_t>(*header_version_ptr) << "." << std::endl;
+
+				size_t header_length = *header_version_ptr >= 2 ? PACKET_V2_HEADER_LENGTH : PACKET_HEADER_LENGTH;
+				recvbuf_ptr->resize(header_length + *payload_size_ptr);
+
+				boost::asio::post(*iocontext_ptr,
+					[]()
+					{
+						recvData(0, 0);
+					});
+			});
+
+		timer->expires_from_now(boost::posix_time::milliseconds(2000));
+		timer->async_wait(
+			[](const boost::system::error_code &err)
+			{
+				if (err.failed()) {
+					return;
+				}
+				std::cout << "REQUEST TIMED OUT" << std::endl;
+				socket_ptr->close();
+			});
+	} catch (...) {
+		std::cout << "Error in recvConnectAck!" << std::endl;
+		std::cout << boost::current_exception_diagnostic_information() << std::endl;
+	}
+}
+
 void sigint_handler(int signal)
 {
     if(signal == SIGINT) {
@@ -232,7 +426,8 @@ int main(int argc, char *argv[])
 
 	if (argc < 4) {
 		std::cout << "Need sample_rate address and port as arguments." << std::endl;
-		std::cout << "recv-udp <sample_rate = [0-3]> <ip> <port>" << std::endl;
+		std::cout << "recv-udp <sample_rate = [0-3]> <ip> <port> [payload_size = " << PACKET_DATA_LENGTH
+			<< ", up to " << PACKET_DATA_LENGTH_MAX << " on jumbo frames] [nack = 1]" << std::endl;
 		return -1;
 	}
 
@@ -247,6 +442,15 @@ int main(int argc, char *argv[])
 			return -1;
 		}
 
+		int payload_size = PACKET_DATA_LENGTH;
+		if (argc > 4) {
+			payload_size = std::stoi(std::string(argv[4]));
+			if (payload_size < 4 || payload_size > PACKET_DATA_LENGTH_MAX) {
+				std::cout << "Payload size out of bounds [4-" << PACKET_DATA_LENGTH_MAX << "]." << std::endl;
+				return -1;
+			}
+		}
+
 		real_sample_rate_ptr = std::make_shared<double>(1.0);
 		if (sample_rate == 0) {
 			*real_sample_rate_ptr = 2e5;
@@ -266,8 +470,13 @@ int main(int argc, char *argv[])
 			std::stoi(std::string(argv[3])));
 
 		data_ptr = std::make_shared<std::vector<uint8_t>>();
-		invalid_ptr = std::make_shared<std::map<uint64_t, uint16_t>>();
-		recvbuf_ptr = std::make_shared<boost::array<uint8_t, 259>>();
+		invalid_ptr = std::make_shared<std::map<uint64_t, uint64_t>>();
+		recvbuf_ptr = std::make_shared<std::vector<uint8_t>>(PACKET_V2_HEADER_LENGTH + PACKET_DATA_LENGTH_MAX);
+		payload_size_ptr = std::make_shared<size_t>(payload_size);
+		header_version_ptr = std::make_shared<uint8_t>(1);
+		chunks_ptr = std::make_shared<std::map<uint64_t, std::vector<uint8_t>>>();
+		nack_ptr = std::make_shared<bool>(argc <= 5 || std::stoi(std::string(argv[5])) != 0);
+		resent_ptr = std::make_shared<uint64_t>(0);
 
 		socket_ptr->connect(server_endpoint);
 		
@@ -290,9 +499,10 @@ int main(int argc, char *argv[])
 			std::cout << "Might experience packet loss." << std::endl;
 		}
 
-		uint8_t send_buffer[2] = { 0, static_cast<uint8_t>(sample_rate) };
+		uint8_t send_buffer[5] = { 0, static_cast<uint8_t>(sample_rate),
+			static_cast<uint8_t>(payload_size & 0xff), static_cast<uint8_t>(payload_size >> 8), HEADER_VERSION };
 
-		socket_ptr->async_send(boost::asio::buffer(send_buffer, 2), 0,
+		socket_ptr->async_send(boost::asio::buffer(send_buffer, 5), 0,
 			[]
 			(const boost::system::error_code &err, std::size_t bytes_transferred)
 			{
@@ -301,7 +511,7 @@ int main(int argc, char *argv[])
 					return;
 				}
 
-				if (bytes_transferred != 2) {
+				if (bytes_transferred != 5) {
 					std::cout << "Didn't send full packet: " << bytes_transferred << std::endl;
 					return;
 				}
@@ -309,7 +519,7 @@ int main(int argc, char *argv[])
 				boost::asio::post(*iocontext_ptr,
 					[]()
 					{
-						recvData(0);
+						recvConnectAck();
 					});
 			});
 
@@ -14,21 +14,24 @@
  */
 
 #include <iostream>
-#include <chrono>
-#include <thread>
 #include <cmath>
 #include <string>
+#include <cstdint>
 
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+
+#include <daqdrv/daqdrv.h>
 
 #include <boost/asio.hpp>
 #include <boost/array.hpp>
 #include <boost/exception/diagnostic_information.hpp>
 
-#define TIMEOUT 50
-#define BUFFER_SIZE 256
+#define TIMEOUT_MS 1000
+#define BUFFER_SIZE 16384
 
 int main(int argc, char *argv[])
 {
@@ -40,6 +43,7 @@ int main(int argc, char *argv[])
 	}
 
 	int const port = std::stoi(std::string(argv[1]));
+	std::string const device_path = argc > 2 ? argv[2] : "/dev/daqdrv0";
 
 	try {
 		boost::asio::io_service io_service;
@@ -56,58 +60,69 @@ int main(int argc, char *argv[])
 
 			std::cout << socket.remote_endpoint() << " connected." << std::endl;
 
-			char buffer[BUFFER_SIZE];
-			int fd = open("/dev/daqdrv", O_RDONLY);
+			int fd = open(device_path.c_str(), O_RDONLY);
 			if (fd == -1) {
-				std::cout << "Error occured when opening /dev/daqdrv: " << errno << std::endl;
+				std::cout << "Error occured when opening " << device_path << ": " << errno << std::endl;
+				return -1;
+			}
+
+			// wake up once per full buffer instead of once per block
+			uint32_t watermark = BUFFER_SIZE;
+			if (ioctl(fd, DAQDRV_IOC_SET_WATERMARK, &watermark) == -1) {
+				std::cout << "Error occured when setting watermark of " << device_path << ": " << errno << std::endl;
+			}
+
+			// data goes from the device through the pipe into the socket without a userspace copy
+			int pipefd[2];
+			if (pipe(pipefd) == -1) {
+				std::cout << "Error occured when creating pipe: " << errno << std::endl;
+				close(fd);
 				return -1;
 			}
+			if (fcntl(pipefd[1], F_SETPIPE_SZ, BUFFER_SIZE) == -1) {
+				std::cout << "Error occured when resizing pipe: " << errno << std::endl;
+			}
+
+			struct pollfd pfd;
+			pfd.fd = fd;
+			pfd.events = POLLIN | POLLRDNORM;
 
 			ssize_t dataRead = 0;
-			int nullCount = 0;
 			while (true) {
-				dataRead = read(fd, buffer, BUFFER_SIZE);
+				int poll_retval = poll(&pfd, 1, TIMEOUT_MS);
+
+				if (poll_retval < 0) {
+					std::cout << "Error occured when polling " << device_path << ": " << errno << std::endl;
+					break;
+				} else if (poll_retval == 0) {
+					std::cout << "Polling " << device_path << " timed out, exiting." << std::endl;
+					break;
+				}
+
+				dataRead = splice(fd, NULL, pipefd[1], NULL, BUFFER_SIZE, SPLICE_F_MOVE);
 
 				if (dataRead == -1) {
-					if (errno == EAGAIN) {
-						nullCount++;
-			
-						if (nullCount == TIMEOUT) {
-							std::cout << TIMEOUT << " consecutive attempts to read failed, exiting." << std::endl;
-							break;
-						} else {
-							std::this_thread::sleep_for(
-								std::chrono::microseconds(200));
-						}
-					} else {
-						std::cout << "Error occured when reading /dev/daqdrv: " << errno << std::endl;
-						break;
-					}
-				} else if (dataRead > 0) {
-
-					try {
-						boost::system::error_code err;
-						auto sent = socket.send(boost::asio::buffer(buffer, BUFFER_SIZE), 0, err);
-					
-						if (err.failed()) {
-							std::cout << "Error occured when writing to socket: " << err.to_string() << std::endl;
-							break;
-						}
-
-						if (sent != BUFFER_SIZE) {
-							std::cout << "Didn't send full buffer: " << sent << std::endl;
-							break;
-						}
-					} catch (...) {
-						std::cout << "Error on socket send" << std::endl;
-						std::cout << boost::current_exception_diagnostic_information() << std::endl;
+					std::cout << "Error occured when splicing from " << device_path << ": " << errno << std::endl;
+					break;
+				}
+
+				ssize_t dataSent = 0;
+				while (dataSent < dataRead) {
+					ssize_t sent = splice(pipefd[0], NULL, socket.native_handle(), NULL, dataRead - dataSent, SPLICE_F_MOVE | SPLICE_F_MORE);
+					if (sent <= 0) {
 						break;
 					}
+					dataSent += sent;
+				}
 
-					nullCount = 0;
+				if (dataSent != dataRead) {
+					std::cout << "Error occured when splicing to socket: " << errno << std::endl;
+					break;
 				}
 			}
 
+			close(pipefd[0]);
+			close(pipefd[1]);
 			close(fd);
 			socket.close();
 		}
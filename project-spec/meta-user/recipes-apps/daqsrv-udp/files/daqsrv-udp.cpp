@@ -20,11 +20,26 @@
 #include <cstdint>
 #include <functional>
 #include <memory>
+#include <vector>
+#include <array>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <deque>
 
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include <daqdrv/daqdrv.h>
 
 #include <boost/asio.hpp>
 #include <boost/array.hpp>
@@ -35,8 +50,8 @@
 
 #define PACKET_SIZE_TYPE sizeof(uint8_t)
 #define PACKET_SIZE_COUNTER sizeof(uint16_t)
-#define PACKET_SIZE_DATA 256
-#define PACKET_SIZE PACKET_SIZE_TYPE + PACKET_SIZE_COUNTER + PACKET_SIZE_DATA
+#define PACKET_SIZE_DATA 256 /* unless the client asks for another size */
+#define PACKET_SIZE_DATA_MAX 8900 /* leaves room for the headers in a 9000 byte jumbo frame */
 
 #define PACKET_OFFSET_TYPE 0
 #define PACKET_OFFSET_COUNTER PACKET_OFFSET_TYPE + PACKET_SIZE_TYPE
@@ -45,6 +60,48 @@
 #define PACKET_TYPE_CONNECT 0
 #define PACKET_TYPE_DISCONNECT 1
 #define PACKET_TYPE_DATA 2
+#define PACKET_TYPE_CONNECT_ACK 3
+#define PACKET_TYPE_DATA_V2 4
+#define PACKET_TYPE_NACK 5
+#define PACKET_TYPE_DATA_RESEND 6
+
+// Header version 2 puts every datagram in time on its own: the index of its
+// first sample since the connection started, lost samples included, and
+// the wall clock time that sample was captured at, both from the driver's
+// block headers. flags tell why samples before the datagram are missing.
+// The counter still numbers the datagrams. A datagram ends early where
+// samples were lost or the rate changed, so it doesn't span either.
+#define PACKET_V2_OFFSET_FLAGS 1 /* uint8 */
+#define PACKET_V2_OFFSET_COUNTER 2 /* uint16 */
+#define PACKET_V2_OFFSET_RATE 4 /* uint32, Hz */
+#define PACKET_V2_OFFSET_INDEX 8 /* uint64 */
+#define PACKET_V2_OFFSET_TIMESTAMP 16 /* uint64, ns since the epoch */
+#define PACKET_V2_OFFSET_DATA 24
+#define PACKET_HEADER_SIZE_MAX PACKET_V2_OFFSET_DATA
+
+#define PACKET_FLAG_DEVICE_LOSS 0x1 /* the driver skipped or dropped blocks, the index counts them */
+#define PACKET_FLAG_SERVER_LOSS 0x2 /* the server's ring had no room, the index counts them */
+#define PACKET_FLAG_DEVICE_DROP 0x4 /* the FPGA overwrote samples, the index counts them as the timestamps tell */
+
+#define BYTES_PER_SAMPLE 2 /* two 12-bit samples in each 32-bit word */
+
+// a connect packet is type and sample rate, optionally followed by the
+// requested payload size as uint16 and then the header version as uint8.
+// Only the long forms get a CONNECT_ACK with what the server settled on,
+// in the same encoding and as long as the request minus the sample rate.
+#define CONNECT_SIZE_SHORT 2
+#define CONNECT_SIZE_LONG 4
+#define CONNECT_SIZE_VERSION 5
+#define CONNECT_ACK_SIZE 3
+#define CONNECT_ACK_SIZE_VERSION 4
+#define HEADER_VERSION_MAX 2
+
+// A NACK asks for datagrams again, by counter: type, number of ranges as
+// uint8, then each range as the uint16 counter of its first datagram and a
+// uint16 count. The datagrams come back as they were sent, but with type
+// PACKET_TYPE_DATA_RESEND, which only makes sense with header version 2.
+#define NACK_RANGES_MAX 64
+#define NACK_SIZE_MAX (2 + 4 * NACK_RANGES_MAX)
 
 void onConnect(boost::asio::ip::udp::socket &socket,
 	boost::asio::ip::udp::endpoint &remote_endpoint,
@@ -57,12 +114,515 @@ typedef std::function<void(
 
 static bool connected = false;
 
+// sample rates the client can ask for in the connect packet
+static const uint32_t sample_rates_hz[] = {200000, 500000, 1000000, 2000000};
+static uint32_t sample_rate_hz = 2000000;
+
+// bytes of samples per datagram for the current connection
+static size_t payload_size = PACKET_SIZE_DATA;
+
+// datagram header of the current connection
+static uint8_t header_version = 1;
+static size_t header_size = PACKET_OFFSET_DATA;
+
+// one server per acquisition channel, the second argument picks it
+static std::string device_path = "/dev/daqdrv0";
+
+// Header version 2 needs the block headers of the driver, which can only be
+// turned on while nobody has the device open. The server turns them off
+// again after a connection if it was the one that turned them on.
+static bool block_headers_ours = false;
+
+// datagrams per sendmmsg() call, the third argument. With 1 every datagram
+// gets its own poll(), read() and async_send_to().
+#define BATCH_PACKETS_MAX 1024 /* UIO_MAXIOV, the most sendmmsg() takes */
+static unsigned int batch_packets = 64;
+
+// the batched mode reports its packets per sendmmsg() this often
+#define BATCH_REPORT_INTERVAL std::chrono::seconds(10)
+
+// In batched mode the kernel can segment a run of datagrams given as one
+// buffer (UDP GSO, since Linux 4.18), which costs one pass through the stack
+// instead of one per datagram. The fourth argument as 0 turns it off.
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#define GSO_SEGMENTS_MAX 64 /* UDP_MAX_SEGMENTS of older kernels */
+#define GSO_BYTES_MAX 65507 /* the largest UDP payload over IPv4 */
+static bool gso_enabled = true;
+
+// The last datagrams sent are kept for NACKs, the seventh argument in MiB, 0
+// ignores NACKs. The eighth argument is how much retransmissions may add to
+// the stream in KiB/s, what doesn't fit waits for the next datagrams sent.
+#define HISTORY_SIZE_MAX 64
+static size_t history_size = 8 << 20;
+static uint32_t resend_budget = 2048 << 10;
+
+// datagrams waiting to be resent, more are skipped
+#define RESEND_QUEUE_MAX 4096
+
+// The ninth argument is how many segments the FPGA buffer is split into, -1
+// picks them from the sample rate and 0 leaves the device as it is. They
+// apply to every reader of the device, so they are only set when this server
+// is its only reader.
+static int fpga_segments = -1;
+
+/*
+ * Copies of the datagrams sent on the current connection, in slots taken in
+ * turn. seq numbers every datagram sent, its counter is the low 16 bits.
+ */
+struct SendHistory {
+	size_t slot_size;
+	std::vector<uint8_t> buf;
+	std::vector<uint16_t> lens;
+	std::vector<uint64_t> seqs;
+	uint64_t next_seq = 0;
+	std::deque<uint64_t> resend;
+	double tokens = 0.0; // bytes the budget allows right now
+	std::chrono::steady_clock::time_point refilled = std::chrono::steady_clock::now();
+	uint64_t nacks = 0;
+	uint64_t resent = 0;
+	uint64_t skipped = 0; // asked for but gone from the history or over the queue
+
+	explicit SendHistory(size_t size)
+		: slot_size(PACKET_HEADER_SIZE_MAX + payload_size), buf(size / slot_size * slot_size),
+		  lens(size / slot_size), seqs(size / slot_size) {}
+
+	size_t slots() const
+	{
+		return lens.size();
+	}
+};
+
+static std::unique_ptr<SendHistory> send_history;
+
+/*
+ * Buffers of the batched send mode for one connection. The datagrams point
+ * into data, their headers are in headers. Without GSO every message is one
+ * datagram, with it a message is a run of datagrams the kernel splits up.
+ */
+struct BatchState {
+	std::vector<uint8_t> data;
+	size_t data_len = 0; // what is left over from the last batch is kept at the front
+	std::vector<std::array<uint8_t, PACKET_HEADER_SIZE_MAX>> headers;
+	std::vector<struct iovec> iov;
+	std::vector<struct mmsghdr> msgs;
+	std::vector<unsigned int> msg_packets; // datagrams in each message
+	unsigned int packets_len = 0;
+	size_t packets_bytes = 0; // samples in the datagrams
+	unsigned int msgs_len = 0;
+	unsigned int msgs_sent = 0;
+	bool gso = false;
+	uint16_t packetCounter = 0;
+	uint64_t packets = 0;
+	uint64_t syscalls = 0;
+	std::chrono::steady_clock::time_point last_report = std::chrono::steady_clock::now();
+
+	explicit BatchState(unsigned int batch)
+		: data(batch * payload_size), headers(batch), iov(2 * batch), msgs(batch), msg_packets(batch) {}
+};
+
+// A thread of its own drains the device into a ring the sender takes the
+// samples from, so a slow network doesn't leave them in the driver until it
+// overruns. The fifth argument is the ring size in MiB, the sixth the core
+// the thread is pinned to, -1 doesn't pin it.
+#define SAMPLE_RING_SIZE_MAX 256
+static size_t sample_ring_size = 16 << 20;
+static int reader_cpu = 1;
+
+// the most the reader asks the device for at once
+#define READER_CHUNK_MAX (64 * 1024)
+
+// marks the ring keeps apart, with all of them pending it counts as full
+#define RING_MARKS_MAX 64
+
+// the capture time of the samples is taken from a block header again at
+// least this often, so the sample clock doesn't drift away from the CPU's
+#define ANCHOR_INTERVAL_NS 1000000000ull
+
+/*
+ * What the samples from ring position at on don't tell by themselves, kept
+ * apart from them so they stay contiguous: how many bytes went missing
+ * before them, and when rate_hz isn't 0, when the sample at at was captured.
+ */
+struct SampleMark {
+	uint64_t at;
+	uint64_t bytes;
+	uint8_t flags; // PACKET_FLAG_*
+	uint32_t rate_hz;
+	uint64_t timestamp_ns;
+};
+
+/*
+ * Single producer, single consumer byte ring between the device reader and
+ * the sender. head and tail only grow, the producer alone moves head and the
+ * consumer tail. event_fd is readable after the producer added data or
+ * stopped. Marks go in a second, smaller ring the same way, consume() stops
+ * at each one until it is taken.
+ */
+struct SampleRing {
+	std::vector<uint8_t> buf;
+	std::atomic<uint64_t> head{0};
+	std::atomic<uint64_t> tail{0};
+	std::atomic<uint64_t> high_water{0}; // the most bytes it held
+	std::atomic<uint64_t> overruns{0}; // device reads it had no room for
+	std::atomic<uint64_t> overrun_bytes{0};
+	std::array<SampleMark, RING_MARKS_MAX> marks;
+	std::atomic<uint64_t> marks_head{0};
+	std::atomic<uint64_t> marks_tail{0};
+	SampleMark pending_mark{0, 0, 0, 0, 0}; // producer: not in marks yet, which was full
+	bool mark_pending = false;
+	int event_fd;
+
+	explicit SampleRing(size_t size)
+		: buf(size), event_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+
+	~SampleRing()
+	{
+		close(event_fd);
+	}
+
+	size_t fill() const
+	{
+		return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+	}
+
+	void notify()
+	{
+		uint64_t one = 1;
+		(void)write(event_fd, &one, sizeof(one));
+	}
+
+	// producer: contiguous free space at head, none while a mark doesn't
+	// fit in marks, it has to stay before anything produced
+	size_t writable(uint8_t **dst)
+	{
+		flushMark();
+		if (mark_pending) {
+			return 0;
+		}
+
+		uint64_t h = head.load(std::memory_order_relaxed);
+		size_t free = buf.size() - (h - tail.load(std::memory_order_acquire));
+		size_t offset = h % buf.size();
+		*dst = buf.data() + offset;
+		return std::min(free, buf.size() - offset);
+	}
+
+	// producer: bytes were lost at head
+	void lose(uint64_t bytes, uint8_t flags)
+	{
+		// a capture time still waiting is for the sample after these
+		if (mark_pending && pending_mark.rate_hz != 0) {
+			pending_mark.timestamp_ns += bytes / BYTES_PER_SAMPLE * 1000000000ull / pending_mark.rate_hz;
+		}
+		pending_mark.bytes += bytes;
+		pending_mark.flags |= flags;
+		mark_pending = true;
+		flushMark();
+	}
+
+	// producer: the sample at head was captured at timestamp_ns
+	void anchor(uint64_t timestamp_ns, uint32_t rate_hz)
+	{
+		pending_mark.timestamp_ns = timestamp_ns;
+		pending_mark.rate_hz = std::max<uint32_t>(rate_hz, 1);
+		mark_pending = true;
+		flushMark();
+	}
+
+	void flushMark()
+	{
+		if (!mark_pending) {
+			return;
+		}
+
+		uint64_t mh = marks_head.load(std::memory_order_relaxed);
+		if (mh - marks_tail.load(std::memory_order_acquire) == marks.size()) {
+			return;
+		}
+
+		pending_mark.at = head.load(std::memory_order_relaxed);
+		marks[mh % marks.size()] = pending_mark;
+		marks_head.store(mh + 1, std::memory_order_release);
+		pending_mark = SampleMark{0, 0, 0, 0, 0};
+		mark_pending = false;
+	}
+
+	void produce(size_t len)
+	{
+		uint64_t h = head.load(std::memory_order_relaxed) + len;
+		head.store(h, std::memory_order_release);
+
+		uint64_t used = h - tail.load(std::memory_order_acquire);
+		if (used > high_water.load(std::memory_order_relaxed)) {
+			high_water.store(used, std::memory_order_relaxed);
+		}
+		notify();
+	}
+
+	bool markPending() const
+	{
+		return marks_tail.load(std::memory_order_relaxed) != marks_head.load(std::memory_order_acquire);
+	}
+
+	// consumer: the next mark is where the consumer is
+	bool markAtTail() const
+	{
+		uint64_t mt = marks_tail.load(std::memory_order_relaxed);
+		return mt != marks_head.load(std::memory_order_acquire)
+			&& marks[mt % marks.size()].at == tail.load(std::memory_order_relaxed);
+	}
+
+	// consumer: only if markAtTail()
+	const SampleMark &peekMark() const
+	{
+		return marks[marks_tail.load(std::memory_order_relaxed) % marks.size()];
+	}
+
+	// consumer: only if markAtTail()
+	SampleMark takeMark()
+	{
+		uint64_t mt = marks_tail.load(std::memory_order_relaxed);
+		SampleMark mark = marks[mt % marks.size()];
+		marks_tail.store(mt + 1, std::memory_order_release);
+		return mark;
+	}
+
+	// consumer: copies out up to len bytes, up to the next mark
+	size_t consume(uint8_t *dst, size_t len)
+	{
+		uint64_t t = tail.load(std::memory_order_relaxed);
+		uint64_t end = head.load(std::memory_order_acquire);
+		uint64_t mt = marks_tail.load(std::memory_order_relaxed);
+		if (mt != marks_head.load(std::memory_order_acquire)) {
+			end = std::min(end, marks[mt % marks.size()].at);
+		}
+		len = std::min<size_t>(len, end - t);
+
+		size_t offset = t % buf.size();
+		size_t first = std::min(len, buf.size() - offset);
+		std::memcpy(dst, buf.data() + offset, first);
+		std::memcpy(dst + first, buf.data(), len - first);
+
+		tail.store(t + len, std::memory_order_release);
+		return len;
+	}
+};
+
+/*
+ * The device side of a connection: the open device, the thread reading it
+ * and the ring it reads into. stop_fd wakes the thread up to stop it.
+ */
+struct DeviceReader {
+	int fd;
+	bool block_headers; // the device puts a struct daqdrv_block_hdr before every block
+	SampleRing ring;
+	int stop_fd;
+	std::atomic<bool> failed{false};
+	std::thread thread;
+
+	// reader thread: the block header read so far, the samples of its block
+	// that are still to come and what the last block said
+	struct daqdrv_block_hdr block_hdr;
+	size_t block_hdr_len = 0;
+	size_t block_left = 0;
+	bool block_seen = false;
+	uint64_t next_sequence = 0;
+	uint64_t last_timestamp_ns = 0;
+	uint64_t anchored_ns = 0;
+	uint32_t block_rate_hz = 0;
+	int64_t clock_offset_ns = 0; // CLOCK_REALTIME - CLOCK_MONOTONIC
+
+	// sender: byte of the stream, lost bytes included, tail of the ring is
+	// at, and the flags of losses not reported in a header yet. The sample
+	// at anchor_pos was captured at anchor_ns, at stream_rate_hz.
+	uint64_t stream_pos = 0;
+	uint8_t stream_flags = 0;
+	uint64_t anchor_pos = 0;
+	uint64_t anchor_ns = 0;
+	uint32_t stream_rate_hz = 0;
+
+	DeviceReader(int fd, bool block_headers, size_t ring_size)
+		: fd(fd), block_headers(block_headers), ring(ring_size), stop_fd(eventfd(0, EFD_CLOEXEC)) {}
+
+	~DeviceReader()
+	{
+		close(stop_fd);
+	}
+};
+
+void recordDatagram(const uint8_t *header, size_t header_len, const uint8_t *data, size_t len)
+{
+	if (send_history == nullptr || send_history->slots() == 0) {
+		return;
+	}
+
+	SendHistory &history = *send_history;
+	uint64_t seq = history.next_seq++;
+	size_t slot = seq % history.slots();
+	uint8_t *copy = history.buf.data() + slot * history.slot_size;
+
+	std::memcpy(copy, header, header_len);
+	std::memcpy(copy + header_len, data, len);
+	copy[PACKET_OFFSET_TYPE] = PACKET_TYPE_DATA_RESEND;
+	history.lens[slot] = header_len + len;
+	history.seqs[slot] = seq;
+}
+
+/*
+ * Queue the datagrams a NACK asks for. A counter stands for the last
+ * datagram sent with it.
+ */
+void queueNack(const uint8_t *nack, size_t len)
+{
+	SendHistory &history = *send_history;
+	history.nacks++;
+
+	size_t ranges = std::min<size_t>(nack[1], (len - 2) / 4);
+	for (size_t i = 0; i < ranges; i++) {
+		uint16_t first;
+		uint16_t count;
+		std::memcpy(&first, nack + 2 + 4 * i, sizeof(first));
+		std::memcpy(&count, nack + 2 + 4 * i + 2, sizeof(count));
+
+		for (uint16_t k = 0; k < count; k++) {
+			uint16_t counter = first + k;
+			uint64_t behind = static_cast<uint16_t>(history.next_seq - 1 - counter);
+			if (history.next_seq == 0 || behind >= history.next_seq || behind >= history.slots()
+				|| history.resend.size() >= RESEND_QUEUE_MAX) {
+				history.skipped++;
+				continue;
+			}
+			history.resend.push_back(history.next_seq - 1 - behind);
+		}
+	}
+}
+
+/*
+ * Resend queued datagrams as far as the budget goes. Called between the
+ * datagrams of the stream, which go first.
+ */
+void sendResends(boost::asio::ip::udp::socket &socket, boost::asio::ip::udp::endpoint &remote_endpoint)
+{
+	if (send_history == nullptr || send_history->resend.empty()) {
+		return;
+	}
+
+	SendHistory &history = *send_history;
+	auto now = std::chrono::steady_clock::now();
+	double elapsed = std::chrono::duration<double>(now - history.refilled).count();
+	double burst = std::max<double>(resend_budget / 10.0, history.slot_size);
+	history.tokens = std::min(burst, history.tokens + elapsed * resend_budget);
+	history.refilled = now;
+
+	while (!history.resend.empty()) {
+		uint64_t seq = history.resend.front();
+		size_t slot = seq % history.slots();
+		if (history.seqs[slot] != seq || history.next_seq - seq > history.slots()) {
+			history.resend.pop_front();
+			history.skipped++;
+			continue;
+		}
+
+		if (history.tokens < history.lens[slot]) {
+			break;
+		}
+
+		ssize_t sent = sendto(socket.native_handle(), history.buf.data() + slot * history.slot_size,
+			history.lens[slot], MSG_DONTWAIT, remote_endpoint.data(), remote_endpoint.size());
+		if (sent == -1) {
+			// the stream has the socket buffer, try again later
+			break;
+		}
+
+		history.resend.pop_front();
+		history.tokens -= history.lens[slot];
+		history.resent++;
+	}
+}
+
+void reportHistoryStats()
+{
+	if (send_history == nullptr || send_history->slots() == 0) {
+		return;
+	}
+
+	std::cout << "Got " << send_history->nacks << " NACKs, resent " << send_history->resent
+		<< " packets, skipped " << send_history->skipped << "." << std::endl;
+}
+
+std::string blockHeadersPath()
+{
+	std::string name = device_path.substr(device_path.find_last_of('/') + 1);
+	return "/sys/kernel/" + name + "/blockHeaders";
+}
+
+bool readBlockHeaders()
+{
+	int fd = open(blockHeadersPath().c_str(), O_RDONLY);
+	if (fd == -1) {
+		return false;
+	}
+
+	char value = '0';
+	ssize_t read_retval = read(fd, &value, 1);
+	close(fd);
+	return read_retval == 1 && value == '1';
+}
+
+bool writeBlockHeaders(bool on)
+{
+	int fd = open(blockHeadersPath().c_str(), O_WRONLY);
+	if (fd == -1) {
+		return false;
+	}
+
+	ssize_t write_retval = write(fd, on ? "1" : "0", 1);
+	close(fd);
+	return write_retval == 1;
+}
+
+/*
+ * Block headers on for header version 2. False if they are off and can't be
+ * turned on, because the device is open elsewhere.
+ */
+bool useBlockHeaders()
+{
+	if (readBlockHeaders()) {
+		return true;
+	}
+
+	if (!writeBlockHeaders(true)) {
+		std::cout << "Error occured when turning on the block headers of " << device_path << ": " << errno << std::endl;
+		return false;
+	}
+	block_headers_ours = true;
+	return true;
+}
+
+/*
+ * Undo useBlockHeaders() once the device is closed.
+ */
+void releaseBlockHeaders()
+{
+	if (!block_headers_ours) {
+		return;
+	}
+
+	block_headers_ours = false;
+	// whoever opened the device meanwhile started with them
+	if (!writeBlockHeaders(false)) {
+		std::cout << device_path << " is open elsewhere, its block headers stay on." << std::endl;
+	}
+}
+
 void waitForConnection(boost::asio::ip::udp::socket &socket,
 	boost::asio::ip::udp::endpoint &remote_endpoint,
 	boost::asio::io_context &io_context,
 	std::shared_ptr<onConnectSignature> completion_handler_ptr)
 {
-	std::shared_ptr<boost::array<uint8_t, 2>> recv_buf_ptr = std::make_shared<boost::array<uint8_t, 2>>();
+	std::shared_ptr<boost::array<uint8_t, CONNECT_SIZE_VERSION>> recv_buf_ptr = std::make_shared<boost::array<uint8_t, CONNECT_SIZE_VERSION>>();
 	try {
 
 		std::cout << "Listening on : " << socket.local_endpoint() << std::endl;
@@ -80,8 +640,10 @@ void waitForConnection(boost::asio::ip::udp::socket &socket,
 						});
 				}
 
-				if (bytes_transferred != 2) {
-					std::cout << "Didn't receive 2 bytes!" << std::endl;
+				if (bytes_transferred != CONNECT_SIZE_SHORT && bytes_transferred != CONNECT_SIZE_LONG
+					&& bytes_transferred != CONNECT_SIZE_VERSION) {
+					std::cout << "Didn't receive " << CONNECT_SIZE_SHORT << ", " << CONNECT_SIZE_LONG
+						<< " or " << CONNECT_SIZE_VERSION << " bytes!" << std::endl;
 					return boost::asio::post(io_context,
 						[&]()
 						{
@@ -98,41 +660,52 @@ void waitForConnection(boost::asio::ip::udp::socket &socket,
 						});
 				}
 
-				std::string sample_rate = std::to_string(static_cast<uint32_t>((*recv_buf_ptr)[1]));
-
-				int fd = open("/sys/kernel/daqdrv/sampleRate", O_WRONLY);
-				if (fd == -1) {
-					std::cout << "Error occured when opening /sys/kernel/daqdrv/sampleRate: " << errno << std::endl;
+				uint8_t sample_rate = (*recv_buf_ptr)[1];
+				if (sample_rate >= sizeof(sample_rates_hz) / sizeof(sample_rates_hz[0])) {
+					std::cout << "Unknown sample rate " << static_cast<uint32_t>(sample_rate) << " requested." << std::endl;
 					return boost::asio::post(io_context,
 						[&]()
 						{
 							waitForConnection(socket, remote_endpoint, io_context, std::make_shared<onConnectSignature>(onConnect));
 						});
 				}
+				sample_rate_hz = sample_rates_hz[sample_rate];
 
-				int ret_write = write(fd, sample_rate.c_str(), sample_rate.size());
+				payload_size = PACKET_SIZE_DATA;
+				header_version = 1;
+				if (bytes_transferred >= CONNECT_SIZE_LONG) {
+					uint16_t requested;
+					std::memcpy(&requested, recv_buf_ptr->data() + 2, sizeof(requested));
 
-				if (ret_write == -1) {
-					close(fd);
-					std::cout << "Error when writing to /sys/kernel/daqdrv/sampleRate: " << errno << std::endl;
-					return boost::asio::post(io_context,
-						[&]()
-						{
-							waitForConnection(socket, remote_endpoint, io_context, std::make_shared<onConnectSignature>(onConnect));
-						});
-				} else if (ret_write == 0) {
-					close(fd);
-					std::cout << "Error when writing to /sys/kernel/daqdrv/sampleRate: nothing was written." << std::endl;
-					return boost::asio::post(io_context,
-						[&]()
-						{
-							waitForConnection(socket, remote_endpoint, io_context, std::make_shared<onConnectSignature>(onConnect));
-						});
-				}
+					// whole 32-bit words of samples, so a datagram never splits a word
+					payload_size = std::max<size_t>(4, std::min<size_t>(requested, PACKET_SIZE_DATA_MAX)) & ~size_t(3);
 
-				close(fd);
+					size_t ack_size = CONNECT_ACK_SIZE;
+					if (bytes_transferred == CONNECT_SIZE_VERSION) {
+						header_version = std::max<uint8_t>(1, std::min<uint8_t>((*recv_buf_ptr)[4], HEADER_VERSION_MAX));
+						ack_size = CONNECT_ACK_SIZE_VERSION;
+					}
+					if (header_version >= 2 && !useBlockHeaders()) {
+						std::cout << "No block headers from " << device_path << ", using header version 1." << std::endl;
+						header_version = 1;
+					}
 
-				std::cout << remote_endpoint << " connected." << std::endl;
+					uint8_t ack[CONNECT_ACK_SIZE_VERSION];
+					ack[PACKET_OFFSET_TYPE] = PACKET_TYPE_CONNECT_ACK;
+					uint16_t confirmed = payload_size;
+					std::memcpy(ack + PACKET_OFFSET_COUNTER, &confirmed, sizeof(confirmed));
+					ack[CONNECT_ACK_SIZE] = header_version;
+
+					boost::system::error_code ack_err;
+					socket.send_to(boost::asio::buffer(ack, ack_size), remote_endpoint, 0, ack_err);
+					if (ack_err.failed()) {
+						std::cout << "Error occured when confirming the payload size: " << ack_err.message() << std::endl;
+					}
+				}
+
+				header_size = header_version >= 2 ? PACKET_V2_OFFSET_DATA : PACKET_OFFSET_DATA;
+				std::cout << remote_endpoint << " connected, " << payload_size << " bytes per packet, header version "
+					<< static_cast<uint32_t>(header_version) << "." << std::endl;
 				connected = true;
 				return (*completion_handler_ptr)(socket, remote_endpoint, io_context);
 
@@ -145,11 +718,14 @@ void waitForConnection(boost::asio::ip::udp::socket &socket,
 	}
 }
 
+/*
+ * Wait for the disconnect packet, NACKs that come meanwhile are queued.
+ */
 void checkDisconnect(boost::asio::ip::udp::socket &socket,
 	boost::asio::ip::udp::endpoint &remote_endpoint,
 	boost::asio::io_context &io_context)
 {
-	std::shared_ptr<boost::array<uint8_t, 1>> recv_buf_ptr = std::make_shared<boost::array<uint8_t, 1>>();
+	std::shared_ptr<boost::array<uint8_t, NACK_SIZE_MAX>> recv_buf_ptr = std::make_shared<boost::array<uint8_t, NACK_SIZE_MAX>>();
 	try {
 
 		socket.async_receive_from(boost::asio::buffer(*recv_buf_ptr), remote_endpoint, 0,
@@ -161,6 +737,14 @@ void checkDisconnect(boost::asio::ip::udp::socket &socket,
 					return;
 				}
 
+				if (bytes_transferred >= 2 && (*recv_buf_ptr)[0] == PACKET_TYPE_NACK) {
+					if (send_history != nullptr && send_history->slots() != 0) {
+						queueNack(recv_buf_ptr->data(), bytes_transferred);
+						sendResends(socket, remote_endpoint);
+					}
+					return checkDisconnect(socket, remote_endpoint, io_context);
+				}
+
 				if (bytes_transferred != 1) {
 					std::cout << "Did not receive packet of length 1." << std::endl;
 					return;
@@ -183,11 +767,340 @@ void checkDisconnect(boost::asio::ip::udp::socket &socket,
 	}
 }
 
+/*
+ * Put len bytes of samples in the ring, what doesn't fit is lost.
+ */
+void putSamples(SampleRing &ring, const uint8_t *src, size_t len)
+{
+	while (len > 0) {
+		uint8_t *dst;
+		size_t n = std::min(ring.writable(&dst), len);
+		if (n == 0) {
+			ring.overruns++;
+			ring.overrun_bytes += len;
+			ring.lose(len, PACKET_FLAG_SERVER_LOSS);
+			return;
+		}
+
+		std::memcpy(dst, src, n);
+		ring.produce(n);
+		src += n;
+		len -= n;
+	}
+}
+
+/*
+ * A block header came in. Blocks the sequence skips were retired before the
+ * reader got to them or dropped by the driver. Blocks the FPGA overwrote
+ * don't show in the sequence, only in how far the timestamp moved.
+ */
+void startBlock(DeviceReader &reader, const struct daqdrv_block_hdr &hdr)
+{
+	uint32_t rate_hz = std::max<uint32_t>(hdr.sample_rate_hz, 1);
+	uint64_t block_samples = hdr.length / BYTES_PER_SAMPLE;
+	uint64_t block_ns = block_samples * 1000000000ull / rate_hz;
+	// the interrupt comes after the last sample of the block
+	uint64_t first_ns = hdr.timestamp_ns + reader.clock_offset_ns - block_ns;
+
+	bool anchor = !reader.block_seen || rate_hz != reader.block_rate_hz
+		|| first_ns - reader.anchored_ns >= ANCHOR_INTERVAL_NS;
+
+	if (reader.block_seen) {
+		int64_t missed = static_cast<int64_t>(hdr.sequence - reader.next_sequence);
+		if (missed > 0) {
+			reader.ring.lose(missed * hdr.length, PACKET_FLAG_DEVICE_LOSS);
+			anchor = true;
+		}
+
+		if ((hdr.flags & DAQDRV_BLOCK_FLAG_OVERWRITE) != 0 && rate_hz == reader.block_rate_hz && block_ns != 0) {
+			uint64_t elapsed_ns = hdr.timestamp_ns - reader.last_timestamp_ns;
+			int64_t overwritten = static_cast<int64_t>((elapsed_ns + block_ns / 2) / block_ns) - 1 - std::max<int64_t>(missed, 0);
+			reader.ring.lose(std::max<int64_t>(overwritten, 0) * hdr.length, PACKET_FLAG_DEVICE_DROP);
+			anchor = true;
+		}
+	}
+
+	if (anchor) {
+		reader.ring.anchor(first_ns, rate_hz);
+		reader.anchored_ns = first_ns;
+	}
+	reader.block_seen = true;
+	reader.next_sequence = hdr.sequence + 1;
+	reader.last_timestamp_ns = hdr.timestamp_ns;
+	reader.block_rate_hz = rate_hz;
+}
+
+/*
+ * Split what a read returned into block headers and samples, a header or
+ * block may continue in the next read. False if the framing is lost.
+ */
+bool takeBlocks(DeviceReader &reader, const uint8_t *src, size_t len)
+{
+	while (len > 0) {
+		if (reader.block_left == 0) {
+			size_t n = std::min(len, sizeof(reader.block_hdr) - reader.block_hdr_len);
+			std::memcpy(reinterpret_cast<uint8_t *>(&reader.block_hdr) + reader.block_hdr_len, src, n);
+			reader.block_hdr_len += n;
+			src += n;
+			len -= n;
+			if (reader.block_hdr_len < sizeof(reader.block_hdr)) {
+				break;
+			}
+
+			reader.block_hdr_len = 0;
+			if (reader.block_hdr.magic != DAQDRV_BLOCK_MAGIC) {
+				std::cout << "Lost the block framing of " << device_path << "." << std::endl;
+				return false;
+			}
+			startBlock(reader, reader.block_hdr);
+			reader.block_left = reader.block_hdr.length;
+			continue;
+		}
+
+		size_t n = std::min(len, reader.block_left);
+		putSamples(reader.ring, src, n);
+		src += n;
+		len -= n;
+		reader.block_left -= n;
+	}
+	return true;
+}
+
+void readDevice(DeviceReader *reader)
+{
+	std::vector<uint8_t> scratch(READER_CHUNK_MAX);
+	struct pollfd pfds[2];
+
+	pfds[0].fd = reader->fd;
+	pfds[0].events = POLLIN | POLLRDNORM;
+	pfds[1].fd = reader->stop_fd;
+	pfds[1].events = POLLIN;
+
+	// block headers have CLOCK_MONOTONIC timestamps, which steady_clock is
+	reader->clock_offset_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count()
+		- std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+
+	while (true) {
+		int poll_retval = poll(pfds, 2, 1000);
+
+		if (poll_retval < 0) {
+			std::cout << "Error occured when polling " << device_path << ": " << errno << std::endl;
+			break;
+		} else if (poll_retval == 0) {
+			std::cout << "Polling " << device_path << " timed out." << std::endl;
+			break;
+		}
+
+		if ((pfds[1].revents & POLLIN) == POLLIN) {
+			return;
+		}
+
+		if ((pfds[0].revents & POLLIN) != POLLIN) {
+			std::cout << "Polling " << device_path << " returned flags " << pfds[0].revents << std::endl;
+			break;
+		}
+
+		// with the ring full the samples are read anyway and dropped, what
+		// the device keeps it would lose later and count on its side. Block
+		// headers are taken out of the samples on the way in.
+		uint8_t *dst = scratch.data();
+		size_t len = scratch.size();
+		if (!reader->block_headers) {
+			len = std::min<size_t>(reader->ring.writable(&dst), READER_CHUNK_MAX);
+		}
+		bool overrun = len == 0;
+		if (overrun) {
+			dst = scratch.data();
+			len = scratch.size();
+		}
+
+		ssize_t read_retval = read(reader->fd, dst, len);
+
+		if (read_retval == -1) {
+			std::cout << "Error occured when reading " << device_path << ": " << errno << std::endl;
+			break;
+		} else if (read_retval == 0) {
+			std::cout << "Reading " << device_path << " returned no data." << std::endl;
+			break;
+		}
+
+		if (reader->block_headers) {
+			if (!takeBlocks(*reader, dst, read_retval)) {
+				break;
+			}
+		} else if (overrun) {
+			reader->ring.overruns++;
+			reader->ring.overrun_bytes += read_retval;
+			reader->ring.lose(read_retval, PACKET_FLAG_SERVER_LOSS);
+		} else {
+			reader->ring.produce(read_retval);
+		}
+	}
+
+	reader->failed = true;
+	reader->ring.notify();
+}
+
+bool pinThread(std::thread &thread, int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+}
+
+std::shared_ptr<DeviceReader> startReader(int fd)
+{
+	// they can't be switched while the device is open
+	auto reader = std::make_shared<DeviceReader>(fd, readBlockHeaders(), sample_ring_size);
+	reader->thread = std::thread(readDevice, reader.get());
+
+	if (reader_cpu >= 0 && !pinThread(reader->thread, reader_cpu)) {
+		std::cout << "Unable to pin the reader of " << device_path << " to core " << reader_cpu << "." << std::endl;
+	}
+	return reader;
+}
+
+/*
+ * The ring's losses are the network's, the device's are readers that fell
+ * behind the driver's ring, which the reader thread should never do.
+ */
+void reportRingStats(DeviceReader &reader)
+{
+	std::cout << "Sample ring peaked at " << reader.ring.high_water << " of " << reader.ring.buf.size()
+		<< " bytes, " << reader.ring.overruns << " overruns lost " << reader.ring.overrun_bytes << " bytes." << std::endl;
+
+	struct daqdrv_overruns device_overruns;
+	if (ioctl(reader.fd, DAQDRV_IOC_GET_OVERRUNS, &device_overruns) == -1) {
+		std::cout << "Error occured when getting overruns of " << device_path << ": " << errno << std::endl;
+	} else {
+		std::cout << device_path << " had " << device_overruns.count << " overruns that lost "
+			<< device_overruns.bytes << " bytes." << std::endl;
+	}
+}
+
+void stopReader(DeviceReader &reader)
+{
+	if (!reader.thread.joinable()) {
+		return;
+	}
+
+	uint64_t one = 1;
+	(void)write(reader.stop_fd, &one, sizeof(one));
+	reader.thread.join();
+	reportRingStats(reader);
+}
+
+/*
+ * Wait until the ring holds at least len bytes or a mark. False if the
+ * reader stopped or nothing came for longer than the reader waits for the
+ * device.
+ */
+bool waitForSamples(DeviceReader &reader, size_t len)
+{
+	while (reader.ring.fill() < len && !reader.ring.markPending()) {
+		if (reader.failed) {
+			return false;
+		}
+
+		struct pollfd pfd;
+
+		pfd.fd = reader.ring.event_fd;
+		pfd.events = POLLIN;
+
+		int poll_retval = poll(&pfd, 1, 2000);
+
+		if (poll_retval < 0) {
+			std::cout << "Error occured when polling the sample ring: " << errno << std::endl;
+			return false;
+		} else if (poll_retval == 0) {
+			std::cout << "Waiting for samples from " << device_path << " timed out." << std::endl;
+			return false;
+		}
+
+		// cleared before looking at the ring again, so no wake up is lost
+		uint64_t events;
+		(void)read(reader.ring.event_fd, &events, sizeof(events));
+	}
+	return true;
+}
+
+/*
+ * Take up to len bytes of samples from the ring into a datagram that holds
+ * pending bytes already. With header version 2 a loss or rate change after
+ * the first byte ends the datagram and sets boundary, the next one starts
+ * after it.
+ */
+size_t takeSamples(DeviceReader &reader, uint8_t *dst, size_t len, size_t pending, bool *boundary)
+{
+	size_t taken = 0;
+	while (taken < len) {
+		if (reader.ring.markAtTail()) {
+			// header version 1 has no way to tell, the samples just go on
+			const SampleMark &next = reader.ring.peekMark();
+			bool splits = next.bytes != 0 || next.flags != 0
+				|| (next.rate_hz != 0 && next.rate_hz != reader.stream_rate_hz);
+			if (header_version >= 2 && splits && pending + taken > 0) {
+				*boundary = true;
+				break;
+			}
+
+			SampleMark mark = reader.ring.takeMark();
+			reader.stream_pos += mark.bytes;
+			reader.stream_flags |= mark.flags;
+			if (mark.rate_hz != 0) {
+				reader.anchor_pos = reader.stream_pos;
+				reader.anchor_ns = mark.timestamp_ns;
+				reader.stream_rate_hz = mark.rate_hz;
+			}
+			continue;
+		}
+
+		size_t consumed = reader.ring.consume(dst + taken, len - taken);
+		if (consumed == 0) {
+			break;
+		}
+		taken += consumed;
+		reader.stream_pos += consumed;
+	}
+	return taken;
+}
+
+/*
+ * Header of a datagram whose samples start at byte pos of the stream, returns
+ * its size. flags only go in the first datagram after the losses.
+ */
+size_t buildHeader(DeviceReader &reader, uint8_t *header, uint16_t counter, uint64_t pos, bool first)
+{
+	if (header_version < 2) {
+		header[PACKET_OFFSET_TYPE] = PACKET_TYPE_DATA;
+		std::memcpy(header + PACKET_OFFSET_COUNTER, &counter, PACKET_SIZE_COUNTER);
+		return PACKET_OFFSET_DATA;
+	}
+
+	// a batch takes its samples before the headers are built, pos may be
+	// before an anchor taken with them
+	uint64_t index = pos / BYTES_PER_SAMPLE;
+	uint32_t rate_hz = std::max<uint32_t>(reader.stream_rate_hz, 1);
+	int64_t since_anchor = static_cast<int64_t>(pos - reader.anchor_pos) / BYTES_PER_SAMPLE;
+	uint64_t timestamp_ns = reader.anchor_ns + since_anchor * 1000000000ll / rate_hz;
+
+	header[PACKET_OFFSET_TYPE] = PACKET_TYPE_DATA_V2;
+	header[PACKET_V2_OFFSET_FLAGS] = first ? reader.stream_flags : 0;
+	std::memcpy(header + PACKET_V2_OFFSET_COUNTER, &counter, sizeof(counter));
+	std::memcpy(header + PACKET_V2_OFFSET_RATE, &rate_hz, sizeof(rate_hz));
+	std::memcpy(header + PACKET_V2_OFFSET_INDEX, &index, sizeof(index));
+	std::memcpy(header + PACKET_V2_OFFSET_TIMESTAMP, &timestamp_ns, sizeof(timestamp_ns));
+	return PACKET_V2_OFFSET_DATA;
+}
+
 void sendData(
 	boost::asio::ip::udp::socket &socket,
 	boost::asio::ip::udp::endpoint &remote_endpoint,
 	boost::asio::io_context &io_context,
-	int driver_fd,
+	std::shared_ptr<DeviceReader> reader,
 	uint16_t packetCounter,
 	std::shared_ptr<std::function<void(void)>> on_disconnect_handler_ptr,
 	std::shared_ptr<std::function<void(void)>> on_error_handler_ptr)
@@ -196,47 +1109,28 @@ void sendData(
 		return (*on_disconnect_handler_ptr)();
 	}
 
-	uint8_t packet_buffer[PACKET_SIZE];
-	struct pollfd pfd;
-
-	pfd.fd = driver_fd;
-	pfd.events = POLLIN | POLLRDNORM;
-
-	int poll_retval = poll(&pfd, 1, 1000);
-
-	if (poll_retval < 0) {
-		std::cout << "Error occured when polling /dev/daqdrv: " << errno << std::endl;
-		return (*on_error_handler_ptr)();
-	} else if (poll_retval == 0) {
-		std::cout << "Polling /dev/daqdrv timed out." << std::endl;
-		return (*on_error_handler_ptr)();
-	}
-
-	if ((pfd.revents & POLLIN) != POLLIN) {
-		std::cout << "Polling /dev/daqdrv returned flags " << pfd.revents << std::endl;
-		return (*on_error_handler_ptr)();
-	}
-
-	ssize_t read_retval = read(driver_fd, packet_buffer + PACKET_OFFSET_DATA, PACKET_SIZE_DATA);
+	// must outlive the send, which completes later when the socket is full
+	auto packet_buffer_ptr = std::make_shared<std::vector<uint8_t>>(PACKET_HEADER_SIZE_MAX + PACKET_SIZE_DATA_MAX);
+	uint8_t *packet_buffer = packet_buffer_ptr->data();
 
-	if (read_retval == -1) {
-		std::cout << "Error occured when reading /dev/daqdrv: " << errno << std::endl;
-		return (*on_error_handler_ptr)();
-	} else if (read_retval == 0) {
-		std::cout << "Reading /dev/daqdrv returned no data." << std::endl;
-		return (*on_error_handler_ptr)();
+	size_t len = 0;
+	bool boundary = false;
+	while (len < payload_size && !boundary) {
+		if (!waitForSamples(*reader, payload_size - len)) {
+			return (*on_error_handler_ptr)();
+		}
+		len += takeSamples(*reader, packet_buffer + header_size + len, payload_size - len, len, &boundary);
 	}
 
 	try {
-		uint8_t *pckt_type = (uint8_t *)((void *)(packet_buffer) + PACKET_OFFSET_TYPE);
-		*pckt_type = PACKET_TYPE_DATA;
-
-		uint16_t *pckt_counter = (uint16_t *)((void *)(packet_buffer) + PACKET_OFFSET_COUNTER);
-		*pckt_counter = packetCounter;
+		buildHeader(*reader, packet_buffer, packetCounter, reader->stream_pos - len, true);
+		reader->stream_flags = 0;
+		size_t const packet_size = header_size + len;
+		recordDatagram(packet_buffer, header_size, packet_buffer + header_size, len);
 
 		boost::system::error_code err;	
-		socket.async_send_to(boost::asio::buffer(packet_buffer, PACKET_SIZE), remote_endpoint, 0,
-			[&socket, &remote_endpoint, &io_context, driver_fd, packetCounter, on_disconnect_handler_ptr, on_error_handler_ptr]
+		socket.async_send_to(boost::asio::buffer(packet_buffer, packet_size), remote_endpoint, 0,
+			[&socket, &remote_endpoint, &io_context, reader, packetCounter, packet_size, packet_buffer_ptr, on_disconnect_handler_ptr, on_error_handler_ptr]
 			(const boost::system::error_code &err, std::size_t bytes_transferred)
 			{
 				if (err.failed()) {
@@ -244,19 +1138,21 @@ void sendData(
 					return (*on_error_handler_ptr)();
 				}
 
-				if (bytes_transferred != PACKET_SIZE) {
+				if (bytes_transferred != packet_size) {
 					std::cout << "Didn't send full packet: " << bytes_transferred << std::endl;
 					return (*on_error_handler_ptr)();
 				}
 
+				sendResends(socket, remote_endpoint);
+
 				boost::asio::post(io_context,
-					[&socket, &remote_endpoint, &io_context, driver_fd, packetCounter, on_disconnect_handler_ptr, on_error_handler_ptr]()
+					[&socket, &remote_endpoint, &io_context, reader, packetCounter, on_disconnect_handler_ptr, on_error_handler_ptr]()
 					{
 						uint16_t newPacketCounter = 0;
 						if (packetCounter != 0xffff) {
 							newPacketCounter = packetCounter + 1;
 						}
-						sendData(socket, remote_endpoint, io_context, driver_fd, newPacketCounter, on_disconnect_handler_ptr, on_error_handler_ptr);
+						sendData(socket, remote_endpoint, io_context, reader, newPacketCounter, on_disconnect_handler_ptr, on_error_handler_ptr);
 					});
 			});
 	
@@ -267,33 +1163,308 @@ void sendData(
 	}
 }
 
+void reportBatchStats(const BatchState &state)
+{
+	double per_call = state.syscalls != 0 ? static_cast<double>(state.packets) / state.syscalls : 0.0;
+	std::cout << "Sent " << state.packets << " packets in " << state.syscalls << " sendmmsg calls"
+		<< (state.gso ? " with GSO, " : ", ") << per_call << " packets per call." << std::endl;
+}
+
+/*
+ * Datagram size the kernel segments sends on the socket into, 0 turns GSO
+ * off. Fails on kernels without UDP_SEGMENT.
+ */
+bool setGsoSize(boost::asio::ip::udp::socket &socket, int size)
+{
+	return setsockopt(socket.native_handle(), SOL_UDP, UDP_SEGMENT, &size, sizeof(size)) == 0;
+}
+
+/*
+ * Group the datagrams prepared in state from first on into messages, as
+ * many per message as GSO takes when it is on.
+ */
+void buildBatchMessages(BatchState &state, boost::asio::ip::udp::endpoint &remote_endpoint, unsigned int first)
+{
+	unsigned int per_msg = 1;
+	if (state.gso) {
+		per_msg = std::min<size_t>(GSO_SEGMENTS_MAX, GSO_BYTES_MAX / (header_size + payload_size));
+	}
+
+	state.msgs_len = 0;
+	state.msgs_sent = 0;
+	for (unsigned int i = first; i < state.packets_len; i += per_msg) {
+		unsigned int packets = std::min(per_msg, state.packets_len - i);
+
+		struct msghdr &msg = state.msgs[state.msgs_len].msg_hdr;
+		std::memset(&msg, 0, sizeof(msg));
+		msg.msg_name = remote_endpoint.data();
+		msg.msg_namelen = remote_endpoint.size();
+		msg.msg_iov = &state.iov[2 * i];
+		msg.msg_iovlen = 2 * packets;
+
+		state.msg_packets[state.msgs_len] = packets;
+		state.msgs_len++;
+	}
+}
+
+void sendDataBatched(
+	boost::asio::ip::udp::socket &socket,
+	boost::asio::ip::udp::endpoint &remote_endpoint,
+	boost::asio::io_context &io_context,
+	std::shared_ptr<DeviceReader> reader,
+	std::shared_ptr<BatchState> state,
+	std::shared_ptr<std::function<void(void)>> on_disconnect_handler_ptr,
+	std::shared_ptr<std::function<void(void)>> on_error_handler_ptr);
+
+/*
+ * Send the datagrams prepared in state from msgs_sent on, then read the
+ * next batch.
+ */
+void sendBatch(
+	boost::asio::ip::udp::socket &socket,
+	boost::asio::ip::udp::endpoint &remote_endpoint,
+	boost::asio::io_context &io_context,
+	std::shared_ptr<DeviceReader> reader,
+	std::shared_ptr<BatchState> state,
+	std::shared_ptr<std::function<void(void)>> on_disconnect_handler_ptr,
+	std::shared_ptr<std::function<void(void)>> on_error_handler_ptr)
+{
+	while (state->msgs_sent < state->msgs_len) {
+		int sent = sendmmsg(socket.native_handle(), state->msgs.data() + state->msgs_sent,
+			state->msgs_len - state->msgs_sent, 0);
+
+		if (sent == -1) {
+			// asio keeps the socket non-blocking, continue when the send buffer drains
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				socket.async_wait(boost::asio::ip::udp::socket::wait_write,
+					[&socket, &remote_endpoint, &io_context, reader, state, on_disconnect_handler_ptr, on_error_handler_ptr]
+					(const boost::system::error_code &err)
+					{
+						if (err.failed()) {
+							std::cout << "Error occured when waiting for socket: " << err.to_string() << std::endl;
+							reportBatchStats(*state);
+							return (*on_error_handler_ptr)();
+						}
+						sendBatch(socket, remote_endpoint, io_context, reader, state, on_disconnect_handler_ptr, on_error_handler_ptr);
+					});
+				return;
+			}
+
+			// the route's MTU or the NIC may rule GSO out even though the
+			// kernel has it, send the rest of the batch datagram by datagram
+			if (state->gso && (errno == EIO || errno == EINVAL)) {
+				std::cout << "Sending with GSO failed: " << errno << ", falling back to sendmmsg." << std::endl;
+				unsigned int first = 0;
+				for (unsigned int i = 0; i < state->msgs_sent; i++) {
+					first += state->msg_packets[i];
+				}
+				setGsoSize(socket, 0);
+				state->gso = false;
+				buildBatchMessages(*state, remote_endpoint, first);
+				continue;
+			}
+
+			std::cout << "Error occured when writing to socket: " << errno << std::endl;
+			reportBatchStats(*state);
+			return (*on_error_handler_ptr)();
+		}
+
+		state->syscalls++;
+		for (int i = 0; i < sent; i++) {
+			state->packets += state->msg_packets[state->msgs_sent + i];
+		}
+		state->msgs_sent += sent;
+	}
+
+	// samples that didn't fill a whole datagram go out with the next batch
+	size_t sent_len = state->packets_bytes;
+	std::memmove(state->data.data(), state->data.data() + sent_len, state->data_len - sent_len);
+	state->data_len -= sent_len;
+	state->packets_len = 0;
+	state->packets_bytes = 0;
+	state->msgs_len = 0;
+	state->msgs_sent = 0;
+
+	sendResends(socket, remote_endpoint);
+
+	auto now = std::chrono::steady_clock::now();
+	if (now - state->last_report >= BATCH_REPORT_INTERVAL) {
+		reportBatchStats(*state);
+		reportRingStats(*reader);
+		reportHistoryStats();
+		state->last_report = now;
+	}
+
+	boost::asio::post(io_context,
+		[&socket, &remote_endpoint, &io_context, reader, state, on_disconnect_handler_ptr, on_error_handler_ptr]()
+		{
+			sendDataBatched(socket, remote_endpoint, io_context, reader, state, on_disconnect_handler_ptr, on_error_handler_ptr);
+		});
+}
+
+/*
+ * Batched counterpart of sendData(): up to batch_packets datagrams worth of
+ * samples from the ring, sent with as few sendmmsg() calls as the socket
+ * allows.
+ */
+void sendDataBatched(
+	boost::asio::ip::udp::socket &socket,
+	boost::asio::ip::udp::endpoint &remote_endpoint,
+	boost::asio::io_context &io_context,
+	std::shared_ptr<DeviceReader> reader,
+	std::shared_ptr<BatchState> state,
+	std::shared_ptr<std::function<void(void)>> on_disconnect_handler_ptr,
+	std::shared_ptr<std::function<void(void)>> on_error_handler_ptr)
+{
+	if (!connected) {
+		reportBatchStats(*state);
+		return (*on_disconnect_handler_ptr)();
+	}
+
+	// at least one whole datagram or what there is up to a loss, as many as
+	// fit if the ring has them
+	bool boundary = false;
+	while (state->data_len < payload_size && !boundary) {
+		if (!waitForSamples(*reader, payload_size - state->data_len)) {
+			return (*on_error_handler_ptr)();
+		}
+		state->data_len += takeSamples(*reader, state->data.data() + state->data_len,
+			state->data.size() - state->data_len, state->data_len, &boundary);
+	}
+
+	// the last datagram before a loss is sent short
+	unsigned int packets = state->data_len / payload_size;
+	size_t packets_bytes = packets * payload_size;
+	if (boundary && packets_bytes < state->data_len) {
+		packets++;
+		packets_bytes = state->data_len;
+	}
+
+	uint64_t pos = reader->stream_pos - state->data_len;
+	for (unsigned int i = 0; i < packets; i++) {
+		size_t offset = i * payload_size;
+		size_t len = std::min(payload_size, packets_bytes - offset);
+
+		std::array<uint8_t, PACKET_HEADER_SIZE_MAX> &header = state->headers[i];
+		size_t header_len = buildHeader(*reader, header.data(), state->packetCounter, pos + offset, i == 0);
+		state->packetCounter++;
+		recordDatagram(header.data(), header_len, state->data.data() + offset, len);
+
+		state->iov[2 * i].iov_base = header.data();
+		state->iov[2 * i].iov_len = header_len;
+		state->iov[2 * i + 1].iov_base = state->data.data() + offset;
+		state->iov[2 * i + 1].iov_len = len;
+	}
+	reader->stream_flags = 0;
+	state->packets_len = packets;
+	state->packets_bytes = packets_bytes;
+	buildBatchMessages(*state, remote_endpoint, 0);
+
+	sendBatch(socket, remote_endpoint, io_context, reader, state, on_disconnect_handler_ptr, on_error_handler_ptr);
+}
+
+/*
+ * Split the FPGA buffer as fpga_segments asks, unless others read the device.
+ */
+void setSegments(int fd, uint32_t rate_hz)
+{
+	if (fpga_segments == 0) {
+		return;
+	}
+
+	struct daqdrv_status status;
+	if (ioctl(fd, DAQDRV_IOC_GET_STATUS, &status) == -1) {
+		std::cout << "Error occured when getting status of " << device_path << ": " << errno << std::endl;
+		return;
+	}
+	if (status.readers != 1) {
+		std::cout << device_path << " has other readers, keeping its " << status.segments << " segments." << std::endl;
+		return;
+	}
+
+	// by default keep the time a block takes to fill about the same at every
+	// rate, the driver rounds this down to what the FPGA supports
+	uint32_t segments = fpga_segments;
+	if (fpga_segments < 0) {
+		segments = sample_rates_hz[3] / rate_hz;
+	}
+	if (ioctl(fd, DAQDRV_IOC_SET_SEGMENTS, &segments) == -1) {
+		std::cout << "Error occured when setting segments of " << device_path << ": " << errno << std::endl;
+	} else {
+		std::cout << "FPGA buffer split into " << segments << " segments." << std::endl;
+	}
+}
+
 void onConnect(boost::asio::ip::udp::socket &socket,
 	boost::asio::ip::udp::endpoint &remote_endpoint,
 	boost::asio::io_context &io_context)
 {
-	int fd = open("/dev/daqdrv", O_RDONLY);
+	int fd = open(device_path.c_str(), O_RDONLY);
 	if (fd == -1) {
-		std::cout << "Error occured when opening /dev/daqdrv: " << errno << std::endl;
+		std::cout << "Error occured when opening " << device_path << ": " << errno << std::endl;
+		releaseBlockHeaders();
 		return;
 	}
 
+	// switches the running acquisition over, data at the old rate is skipped
+	uint32_t rate_hz = sample_rate_hz;
+	if (ioctl(fd, DAQDRV_IOC_SET_RATE, &rate_hz) == -1) {
+		std::cout << "Error occured when setting sample rate of " << device_path << ": " << errno << std::endl;
+		close(fd);
+		releaseBlockHeaders();
+		connected = false;
+		return boost::asio::post(io_context,
+			[&]()
+			{
+				waitForConnection(socket, remote_endpoint, io_context, std::make_shared<onConnectSignature>(onConnect));
+			});
+	}
+	std::cout << "Sampling at " << rate_hz << " Hz." << std::endl;
+
+	setSegments(fd, rate_hz);
+
+	send_history = std::make_unique<SendHistory>(history_size);
 	checkDisconnect(socket, remote_endpoint, io_context);
 
-	sendData(socket, remote_endpoint, io_context, fd, 0, std::make_shared<std::function<void(void)>>(
-		[fd, &socket, &remote_endpoint, &io_context]()
+	auto reader = startReader(fd);
+
+	auto on_disconnect_handler_ptr = std::make_shared<std::function<void(void)>>(
+		[fd, reader, &socket, &remote_endpoint, &io_context]()
 		{
+			stopReader(*reader);
+			reportHistoryStats();
 			close(fd);
+			releaseBlockHeaders();
 			boost::asio::post(io_context,
 				[&]()
 				{
 					waitForConnection(socket, remote_endpoint, io_context, std::make_shared<onConnectSignature>(onConnect));
 				});
-		}),
-		std::make_shared<std::function<void(void)>>(
-		[fd]()
+		});
+	auto on_error_handler_ptr = std::make_shared<std::function<void(void)>>(
+		[fd, reader]()
 		{
+			stopReader(*reader);
+			reportHistoryStats();
 			close(fd);
-		}));
+			releaseBlockHeaders();
+		});
+
+	if (batch_packets > 1) {
+		auto state = std::make_shared<BatchState>(batch_packets);
+		if (gso_enabled) {
+			// a send no longer than one datagram goes out as it is, the
+			// connect ack included
+			state->gso = setGsoSize(socket, header_size + payload_size);
+			if (!state->gso) {
+				std::cout << "UDP GSO not supported: " << errno << ", sending with sendmmsg." << std::endl;
+			}
+		}
+		sendDataBatched(socket, remote_endpoint, io_context, reader, state,
+			on_disconnect_handler_ptr, on_error_handler_ptr);
+	} else {
+		sendData(socket, remote_endpoint, io_context, reader, 0, on_disconnect_handler_ptr, on_error_handler_ptr);
+	}
 }
 
 int main(int argc, char *argv[])
@@ -306,6 +1477,37 @@ int main(int argc, char *argv[])
 	}
 
 	int const port = std::stoi(std::string(argv[1]));
+	if (argc > 2) {
+		device_path = argv[2];
+	}
+	if (argc > 3) {
+		int batch = std::stoi(std::string(argv[3]));
+		batch_packets = std::max(1, std::min(batch, BATCH_PACKETS_MAX));
+	}
+	if (argc > 4) {
+		gso_enabled = std::stoi(std::string(argv[4])) != 0;
+	}
+	if (argc > 5) {
+		int mib = std::stoi(std::string(argv[5]));
+		sample_ring_size = static_cast<size_t>(std::max(1, std::min(mib, SAMPLE_RING_SIZE_MAX))) << 20;
+	}
+	if (argc > 6) {
+		reader_cpu = std::stoi(std::string(argv[6]));
+	}
+	if (argc > 7) {
+		int mib = std::stoi(std::string(argv[7]));
+		history_size = static_cast<size_t>(std::max(0, std::min(mib, HISTORY_SIZE_MAX))) << 20;
+	}
+	if (argc > 8) {
+		resend_budget = static_cast<uint32_t>(std::max(1, std::stoi(std::string(argv[8])))) << 10;
+	}
+	if (argc > 9) {
+		fpga_segments = std::stoi(std::string(argv[9]));
+	}
+	if (batch_packets > 1) {
+		std::cout << "Sending up to " << batch_packets << " packets per sendmmsg"
+			<< (gso_enabled ? ", segmented by UDP GSO." : ".") << std::endl;
+	}
 
 	try {
 		boost::asio::io_context io_context;
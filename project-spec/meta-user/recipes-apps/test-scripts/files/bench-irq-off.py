@@ -0,0 +1,56 @@
+#  Copyright 2025, University of Ljubljana
+#
+#  This file is part of Cora-Z7-DAQ-OS.
+#  Cora-Z7-DAQ-OS is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by the Free Software Foundation,
+#  either version 3 of the License, or any later version.
+#  Cora-Z7-DAQ-OS is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+#  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+#  You should have received a copy of the GNU General Public License along with Cora-Z7-DAQ-OS.
+#  If not, see <https://www.gnu.org/licenses/>.
+
+# Compares the worst case time spent in the hard IRQ handler of daqdrv
+# with and without threaded_irq, for every sample rate.
+# Stop daqsrv-udp before running, the script reloads the driver.
+
+import subprocess
+import sys
+import time
+
+DEVICE = 'daqdrv0'
+SYSFS = f'/sys/kernel/{DEVICE}'
+RATES = ['200 kSPS', '500 kSPS', '1 MSPS', '2 MSPS']
+
+duration = 5.0
+if len(sys.argv) > 1:
+    duration = float(sys.argv[1])
+
+def load_driver(threaded):
+    subprocess.run(['modprobe', '-r', 'daqdrv'], check=False)
+    subprocess.run(['modprobe', 'daqdrv', f'threaded_irq={int(threaded)}'], check=True)
+
+def measure(rate):
+    with open(f'{SYSFS}/sampleRate', 'w') as f:
+        f.write(str(rate))
+    with open(f'{SYSFS}/irqOffMaxNs', 'w') as f:
+        f.write('0')
+
+    dev = open(f'/dev/{DEVICE}', 'rb', buffering=0)
+    start = time.monotonic()
+    while time.monotonic() - start < duration:
+        dev.read(16384)
+    dev.close()
+
+    with open(f'{SYSFS}/irqOffMaxNs', 'r') as f:
+        return int(f.read())
+
+results = {}
+for threaded in [False, True]:
+    load_driver(threaded)
+    for rate in range(len(RATES)):
+        results[(threaded, rate)] = measure(rate)
+
+print(f'{"rate":>10} {"hard IRQ / us":>15} {"threaded / us":>15}')
+for rate in range(len(RATES)):
+    print(f'{RATES[rate]:>10} {results[(False, rate)] / 1000:>15.1f} {results[(True, rate)] / 1000:>15.1f}')
@@ -10,10 +10,11 @@
 #  You should have received a copy of the GNU General Public License along with Cora-Z7-DAQ-OS.
 #  If not, see <https://www.gnu.org/licenses/>.
 
+import sys
 import time
 
 data = bytes()
-file = open('/dev/daqdrv', 'rb')
+file = open(sys.argv[1] if len(sys.argv) > 1 else '/dev/daqdrv0', 'rb')
 for i in range(0,8):
     data = data + file.read(1024)
 file.close()
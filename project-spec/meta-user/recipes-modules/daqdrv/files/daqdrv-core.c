@@ -23,16 +23,39 @@
 #include <linux/io.h>
 #include <linux/interrupt.h>
 #include <linux/cdev.h>
+#include <linux/idr.h>
 #include <linux/sysfs.h>
 #include <linux/kobject.h>
 #include <linux/wait.h>
 #include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/iopoll.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <uapi/linux/sched/types.h>
+#include <linux/dmaengine.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
 
 #include <linux/of_address.h>
 #include <linux/of_device.h>
 #include <linux/of_platform.h>
 
 #include "kfifo-iomod.h"
+#include "daqdrv.h"
+#include "daqdrv-sim.h"
+#include "daqdrv-neon.h"
+
+#define CREATE_TRACE_POINTS
+#include "daqdrv-trace.h"
 
 /* Standard module information, edit as appropriate */
 MODULE_LICENSE("GPL");
@@ -43,13 +66,70 @@ MODULE_DESCRIPTION
 
 #define DRIVER_NAME "daqdrv"
 
+static bool threaded_irq;
+module_param(threaded_irq, bool, 0444);
+MODULE_PARM_DESC(threaded_irq, "Copy FPGA blocks in a threaded IRQ handler instead of the hard IRQ");
+
+static int irq_thread_prio = MAX_RT_PRIO / 2;
+module_param(irq_thread_prio, int, 0444);
+MODULE_PARM_DESC(irq_thread_prio, "SCHED_FIFO priority of the IRQ thread, 1-99 (default 50)");
+
+static bool use_dma = true;
+module_param(use_dma, bool, 0444);
+MODULE_PARM_DESC(use_dma, "Move FPGA blocks with a dmaengine memcpy channel when one is available");
+
+static char *copy_strategy = "auto";
+module_param(copy_strategy, charp, 0444);
+MODULE_PARM_DESC(copy_strategy, "How the CPU copies FPGA blocks: auto (fastest at probe), memcpy_fromio, readl or neon");
+
 #define FPGA_BUF_LEN 4096
 #define FIFO_BUF_LEN FPGA_BUF_LEN * 8
 
+/* limits of the ring size in bytes, it must hold a few blocks */
+#define RING_SIZE_MIN (FPGA_BUF_LEN * 16)
+#define RING_SIZE_MAX (1u << 28)
+
+/* each 32-bit word of the FPGA buffer holds two 12-bit samples */
+#define BYTES_PER_SAMPLE 2
+
+static unsigned int ring_size = FIFO_BUF_LEN * 4;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Initial size of the capture ring in bytes, rounded up to a power of 2");
+
+static unsigned int dac_ring_size = FIFO_BUF_LEN * 4;
+module_param(dac_ring_size, uint, 0444);
+MODULE_PARM_DESC(dac_ring_size, "Size of the DAC output ring in bytes, rounded up to a power of 2");
+
+/* enough entries for a block that spans every page plus the fifo wrap */
+#define DMA_SGL_LEN (4*FPGA_BUF_LEN / PAGE_SIZE + 2)
+
 #define ADC_RUN_BIT 0
 #define DAC_RUN_BIT 1
 #define CLEAR_BIT_C 2
 
+/*
+ * ctrl register with the words of the DAC buffer the FPGA plays before it
+ * wraps around, 0 for the whole buffer. The DAC buffer itself is the
+ * optional fifth region. The DAC plays word n mod length at the n-th sample
+ * since the last clear, so it is in step with the ADC segments as long as
+ * the whole buffer is played.
+ */
+#define DAC_LEN_REG 0x4
+
+/*
+ * log2 of the number of interrupts per FPGA buffer lives in ctrl bits 5:4,
+ * each interrupt then announces the next segment of the buffer. Bitstreams
+ * that don't implement the field interrupt once per buffer, which is why
+ * more than one segment has to be enabled with fpga_max_segments.
+ */
+#define SEGMENTS_SHIFT 4
+#define SEGMENTS_MASK  0x3
+#define SEGMENTS_MAX   8
+
+static unsigned int fpga_max_segments = 1;
+module_param(fpga_max_segments, uint, 0444);
+MODULE_PARM_DESC(fpga_max_segments, "Segments per FPGA buffer the bitstream can interrupt for, 1, 2, 4 or 8 (default 1)");
+
 #define OVERWRITE_BIT 0
 
 #define CLK_SOFT_RST_REG         0x0
@@ -69,14 +149,28 @@ MODULE_DESCRIPTION
 #define SAMPLE_RATE_1MSPS   0x2
 #define SAMPLE_RATE_2MSPS   0x3
 
-#define SR_200KSPS_R0 0x00000801
-#define SR_200KSPS_R2 0x0000007d
-#define SR_500KSPS_R0 0x00000a01
-#define SR_500KSPS_R2 0x0001f43e
-#define SR_1MSPS_R0   0x00000a01
-#define SR_1MSPS_R2   0x0000fa1f
-#define SR_2MSPS_R0   0x00000a01
-#define SR_2MSPS_R2   0x0002710f
+#define SAMPLE_RATE_MIN_HZ 150000
+#define SAMPLE_RATE_MAX_HZ 2000000
+
+/* the ADC takes this many cycles of clk_out1 per sample */
+#define CLK_PER_SAMPLE 32
+
+#define CLK_LOCKED_BIT 0
+
+/*
+ * MMCM of the clocking wizard, see the clk_wiz node in pl.dtsi and the 7 series
+ * clocking guide. Multiply and output divide are fractional in steps of 1/8,
+ * so they are kept in eighths.
+ */
+#define MMCM_FIN_HZ     100000000ULL
+#define MMCM_VCO_MIN_HZ 600000000ULL
+#define MMCM_VCO_MAX_HZ 1200000000ULL
+#define MMCM_PFD_MIN_HZ 10000000ULL
+#define MMCM_D_MAX      80
+#define MMCM_M8_MIN     (2 * 8)
+#define MMCM_M8_MAX     (64 * 8)
+#define MMCM_O8_MIN     (2 * 8) /* 1 is allowed too, but not fractional */
+#define MMCM_O8_MAX     (128 * 8)
 
 #define REG_SET_BIT(reg, bit) reg = reg | (1u << bit)
 #define REG_UNSET_BIT(reg, bit) reg = reg & ~(1u << bit)
@@ -85,32 +179,75 @@ MODULE_DESCRIPTION
 static void sampleRate_release(struct kobject *);
 static ssize_t sampleRate_store(struct kobject *, struct kobj_attribute *, const char *, size_t);
 static irqreturn_t daqdrv_irq(int, void *);
+static irqreturn_t daqdrv_irq_top(int, void *);
+static irqreturn_t daqdrv_irq_thread(int, void *);
 static int daqdrv_open(struct inode *, struct file *);
 static int daqdrv_release(struct inode *, struct file *);
-static ssize_t daqdrv_read(struct file *, char __user *, size_t, loff_t *);
+static ssize_t daqdrv_read_iter(struct kiocb *, struct iov_iter *);
 static ssize_t daqdrv_write(struct file *, const char __user *, size_t, loff_t *);
 static unsigned int daqdrv_poll(struct file *, struct poll_table_struct *);
+static int daqdrv_mmap(struct file *, struct vm_area_struct *);
+static long daqdrv_ioctl(struct file *, unsigned int, unsigned long);
+static int daqdrv_switch_rate(struct daqdrv_local *, u32);
 
-static int major; /* major number assigned to our device driver */
-static int num_of_dev = 1;
-enum {
-	CDEV_NOT_USED,
-	CDEV_EXCLUSIVE_OPEN
-};
-static atomic_t already_open = ATOMIC_INIT(CDEV_NOT_USED);
+/* every instance gets a minor and the number in /dev/daqdrvN from these */
+#define DAQDRV_MAX_DEVICES 8
 
-static struct class *cls;
+static dev_t daqdrv_devt; /* first of DAQDRV_MAX_DEVICES minors */
+static struct class *daqdrv_class;
+static DEFINE_IDA(daqdrv_ida);
 
 static struct file_operations chardev_fops = {
-	.read = daqdrv_read,
+	.read_iter = daqdrv_read_iter,
+	.splice_read = copy_splice_read,
 	.write = daqdrv_write,
 	.open = daqdrv_open,
 	.release = daqdrv_release,
 	.poll = daqdrv_poll,
+	.mmap = daqdrv_mmap,
+	.unlocked_ioctl = daqdrv_ioctl,
+};
+
+/*
+ * Counters in /sys/kernel/daqdrvN/statistics, cumulative since the module
+ * was loaded. The IRQ path writes them, except the ones about readers.
+ */
+struct daqdrv_stats {
+	atomic64_t irqs;
+	atomic64_t blocks_accepted;
+	atomic64_t blocks_dropped;
+	atomic64_t overwrites;
+	atomic64_t bytes_read; /* by read() and splice(), mmap readers are not counted */
+	atomic64_t reader_overruns;
+	atomic64_t dac_underruns;
+	u32 peak_fill; /* bytes the furthest behind reader had to catch up */
+	u32 irq_service_max_ns; /* from the interrupt until the block is in the fifo */
+};
+
+#define LAT_HIST_BUCKETS 32
+
+/*
+ * log2 histogram of a latency in /sys/kernel/debug/daqdrvN, bucket i counts
+ * latencies of 2^i to 2^(i+1)-1 ns.
+ */
+struct daqdrv_lat_hist {
+	atomic_t buckets[LAT_HIST_BUCKETS];
+};
+
+/*
+ * A way for the CPU to copy a block out of the FPGA buffer.
+ */
+struct daqdrv_copy_strategy {
+	const char *name;
+	kfifo_iomod_copy_t copy;
+	bool hardirq; /* works in the hard IRQ handler */
 };
 
 struct daqdrv_local {
 	int irq;
+	int id; /* N of /dev/daqdrvN */
+	char name[16]; /* daqdrvN, also of the sysfs and debugfs directories */
+	dev_t devt;
 	struct cdev chardev;
 	unsigned long buffer_mem_start;
 	unsigned long buffer_mem_end;
@@ -120,16 +257,79 @@ struct daqdrv_local {
 	unsigned long stat_mem_end;
 	unsigned long clk_mem_start;
 	unsigned long clk_mem_end;
+	unsigned long dac_mem_start;
+	unsigned long dac_mem_end;
 	void __iomem *buffer_base_addr;
 	void __iomem *ctrl_base_addr;
 	void __iomem *stat_base_addr;
 	void __iomem *clk_base_addr;
+	void __iomem *dac_base_addr; /* NULL if the FPGA design has no DAC buffer */
+	const struct daqdrv_copy_strategy *copy;
+	const struct daqdrv_sim_pdata *sim; /* NULL unless bound to daqdrv-sim */
 	struct kfifo_iomod fifo;
+	struct daqdrv_ring_ctrl *ring_ctrl;
 	struct kobject sampleRate_module_object;
 	struct wait_queue_head wait_queue_head;
-	bool overflowing;
-	bool prev_overflowing;
-	bool allowed_to_read;
+	struct mutex open_mutex;
+	int open_count; /* the first open starts the acquisition, the last release stops it */
+	u32 latency_budget_ms; /* for ringSizeSuggested */
+	u32 sample_rate_hz; /* what the clocking wizard actually produces */
+	bool allowed_to_read; /* the acquisition is running */
+	/* latched by the top half in threaded mode */
+	spinlock_t irq_lock;
+	u64 irq_seq;
+	u64 irq_time_ns;
+	u32 irq_stat;
+	u64 thread_next_seq;
+	bool thread_prio_set;
+	/* header of the block being copied, see daqdrv.h */
+	bool block_headers;
+	struct daqdrv_block_hdr block_hdr;
+	u64 next_seq;
+	bool rate_changed; /* the next block is the first at a new sample rate */
+	/* the FPGA buffer is drained in segments, one per interrupt */
+	u32 max_segments;
+	u32 segments;
+	u32 seg_len;
+	u64 seg_seq0; /* sequence number of the interrupt for segment 0 */
+	u32 irq_off_max_ns; /* longest time spent in the hard IRQ handler */
+	/* NULL when blocks are copied by the CPU */
+	struct dma_chan *dma_chan;
+	dma_addr_t dma_src;
+	struct scatterlist dma_sgl[DMA_SGL_LEN];
+	int dma_nents;
+	u32 dma_stat;
+	bool dma_busy;
+	struct daqdrv_stats stats;
+	struct dentry *debugfs_dir;
+	struct daqdrv_lat_hist lat_irq_service; /* interrupt until the block is in the fifo */
+	struct daqdrv_lat_hist lat_irq_to_wakeup; /* interrupt of the newest block until a reader notices it */
+	struct daqdrv_lat_hist lat_wakeup_to_read; /* reader noticed data until it was copied out */
+	atomic64_t last_irq_ns; /* interrupt time of the newest block in the fifo */
+	/* output ring, only if there is a DAC buffer */
+	spinlock_t dac_lock; /* the refill against loop switches */
+	struct mutex dac_mutex; /* serializes write() */
+	struct daqdrv_dac_ctrl *dac_ctrl;
+	void *dac_ring;
+	u32 dac_ring_size;
+	u32 dac_consumer;
+	u32 dac_last_word; /* played while the ring is empty */
+	u32 dac_loop_len;
+	bool dac_streaming; /* data was written since the start, so running dry is an underrun */
+};
+
+/*
+ * State of one open file of /dev/daqdrvN.
+ */
+struct daqdrv_reader {
+	struct mutex read_mutex;
+	u32 watermark; /* bytes that must be buffered before read/poll wake up */
+	u32 cursor; /* fifo position of the next byte for this reader */
+	u64 overruns; /* times the IRQ retired data this reader hadn't read yet */
+	u64 lost_bytes;
+	u64 wake_ns; /* when poll or read noticed new data, 0 once it was read */
+	bool overflowing; /* losing data, for the overflow tracepoints */
+	u64 overflow_bytes; /* lost since overflowing was set */
 };
 
 static const struct kobj_type dynamic_kobj_ktype = {
@@ -142,7 +342,146 @@ static void sampleRate_release(struct kobject *kobj)
 	pr_debug("(%p): %s\n", kobj, __func__);
 }
 
-static u8 sampleRate;
+static u32 daqdrv_sample_rate_hz(u8 rate)
+{
+	switch (rate) {
+	case SAMPLE_RATE_200KSPS:
+		return 200000;
+	case SAMPLE_RATE_500KSPS:
+		return 500000;
+	case SAMPLE_RATE_1MSPS:
+		return 1000000;
+	case SAMPLE_RATE_2MSPS:
+		return 2000000;
+	default:
+		return 0;
+	}
+}
+
+struct daqdrv_mmcm {
+	u32 d;
+	u32 m8;
+	u32 o8;
+};
+
+/*
+ * Find the divider settings whose output is closest to the clock the ADC
+ * needs for rate_hz. Among equally good ones integer dividers win over
+ * fractional ones and then the highest VCO, both give less jitter.
+ * Returns the output frequency in Hz.
+ */
+static u32 daqdrv_mmcm_solve(u32 rate_hz, struct daqdrv_mmcm *best)
+{
+	u32 fout = rate_hz * CLK_PER_SAMPLE;
+	u32 best_err = U32_MAX;
+	u32 best_frac = 0;
+	u64 best_vco8 = 0;
+	u32 best_fout = 0;
+
+	for (u32 d = 1; d <= MMCM_D_MAX && div_u64(MMCM_FIN_HZ, d) >= MMCM_PFD_MIN_HZ; d++) {
+		for (u32 m8 = MMCM_M8_MIN; m8 <= MMCM_M8_MAX; m8++) {
+			// VCO frequency times 8
+			u64 vco8 = div_u64(MMCM_FIN_HZ * m8, d);
+			if (vco8 < MMCM_VCO_MIN_HZ * 8 || vco8 > MMCM_VCO_MAX_HZ * 8) {
+				continue;
+			}
+
+			u32 o8 = (u32)div_u64(vco8 + fout / 2, fout);
+			if (o8 < MMCM_O8_MIN && o8 != 8) {
+				continue;
+			}
+			if (o8 > MMCM_O8_MAX) {
+				continue;
+			}
+
+			u32 f = (u32)div_u64(vco8, o8);
+			u32 err = f > fout ? f - fout : fout - f;
+			u32 frac = (m8 % 8 != 0) + (o8 % 8 != 0);
+			if (err > best_err) {
+				continue;
+			}
+			if (err == best_err && (frac > best_frac || (frac == best_frac && vco8 <= best_vco8))) {
+				continue;
+			}
+
+			best_err = err;
+			best_frac = frac;
+			best_vco8 = vco8;
+			best_fout = f;
+			best->d = d;
+			best->m8 = m8;
+			best->o8 = o8;
+		}
+	}
+
+	return best_fout;
+}
+
+/*
+ * Program the clocking wizard for the closest possible rate to rate_hz and
+ * wait for the MMCM to lock. On failure the vivado generated settings are
+ * restored.
+ */
+static int daqdrv_set_sample_rate(struct daqdrv_local *lp, u32 rate_hz)
+{
+	struct daqdrv_mmcm mmcm;
+
+	u32 fout = daqdrv_mmcm_solve(rate_hz, &mmcm);
+	if (fout == 0) {
+		return -ERANGE;
+	}
+
+	// fractional parts are written in thousandths
+	u32 reg0 = mmcm.d | ((mmcm.m8 / 8) << 8) | (((mmcm.m8 % 8) * 125) << 16);
+	u32 reg2 = (mmcm.o8 / 8) | (((mmcm.o8 % 8) * 125) << 8);
+
+	iowrite32(reg0, lp->clk_base_addr + CLK_CLK_CONF_REG_0);
+	iowrite32(reg2, lp->clk_base_addr + CLK_CLK_CONF_REG_2);
+
+	iowrite32(2, lp->clk_base_addr + CLK_CLK_CONF_REG_23); // use registers we just set instead of vivado generated settings
+	iowrite32(3, lp->clk_base_addr + CLK_CLK_CONF_REG_23); // apply
+
+	u32 clk_stat_reg;
+	int ret_lock = readl_poll_timeout(lp->clk_base_addr + CLK_STAT_REG, clk_stat_reg,
+		REG_GET_BIT(clk_stat_reg, CLK_LOCKED_BIT), 100, 100000);
+
+	u32 clk_monitor_err_stat_reg = ioread32(lp->clk_base_addr + CLK_MONITOR_ERR_STAT_REG);
+
+	if (ret_lock || clk_monitor_err_stat_reg) {
+		printk("error configuring clock!");
+		printk("clk_stat_reg is %#010x, clk_monitor_err_stat_reg is %#010x\n", clk_stat_reg, clk_monitor_err_stat_reg);
+		iowrite32(0, lp->clk_base_addr + CLK_CLK_CONF_REG_23); // fallback to vivado generated settings
+		iowrite32(1, lp->clk_base_addr + CLK_CLK_CONF_REG_23); // apply
+		lp->sample_rate_hz = SAMPLE_RATE_MAX_HZ;
+		WRITE_ONCE(lp->ring_ctrl->sample_rate_hz, lp->sample_rate_hz);
+		return -EIO;
+	}
+
+	lp->sample_rate_hz = DIV_ROUND_CLOSEST(fout, CLK_PER_SAMPLE);
+	WRITE_ONCE(lp->ring_ctrl->sample_rate_hz, lp->sample_rate_hz);
+	printk("Sample rate set to %u Hz (D %u, M %u.%03u, O %u.%03u)\n", lp->sample_rate_hz,
+		mmcm.d, mmcm.m8 / 8, (mmcm.m8 % 8) * 125, mmcm.o8 / 8, (mmcm.o8 % 8) * 125);
+	return 0;
+}
+
+/*
+ * Rate changes from sysfs and ioctl, a running acquisition switches over
+ * without stopping, see daqdrv_switch_rate().
+ */
+static int daqdrv_change_sample_rate(struct daqdrv_local *lp, u32 rate_hz)
+{
+	int ret_rate;
+
+	mutex_lock(&(lp->open_mutex));
+	if (lp->allowed_to_read == true) {
+		ret_rate = daqdrv_switch_rate(lp, rate_hz);
+	} else {
+		ret_rate = daqdrv_set_sample_rate(lp, rate_hz);
+	}
+	mutex_unlock(&(lp->open_mutex));
+
+	return ret_rate;
+}
 
 static ssize_t sampleRate_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
 {
@@ -156,42 +495,19 @@ static ssize_t sampleRate_store(struct kobject *kobj, struct kobj_attribute *att
 		return -ENOTRECOVERABLE;
 	}
 
-	if (lp->allowed_to_read == true) {
-		return -EBUSY;
-	}
-
 	unsigned long number = 0;
 	int ret_conversion = kstrtoul(buf, 10, &number);
 	if (ret_conversion) {
 		return ret_conversion;
 	}
 
-	if (number == SAMPLE_RATE_2MSPS) {
-		iowrite32(SR_2MSPS_R0, lp->clk_base_addr + CLK_CLK_CONF_REG_0);
-		iowrite32(SR_2MSPS_R2, lp->clk_base_addr + CLK_CLK_CONF_REG_2);
-	} else if(number == SAMPLE_RATE_1MSPS) {
-		iowrite32(SR_1MSPS_R0, lp->clk_base_addr + CLK_CLK_CONF_REG_0);
-		iowrite32(SR_1MSPS_R2, lp->clk_base_addr + CLK_CLK_CONF_REG_2);
-	} else if(number == SAMPLE_RATE_500KSPS) {
-		iowrite32(SR_500KSPS_R0, lp->clk_base_addr + CLK_CLK_CONF_REG_0);
-		iowrite32(SR_500KSPS_R2, lp->clk_base_addr + CLK_CLK_CONF_REG_2);
-	} else if(number == SAMPLE_RATE_200KSPS) {
-		iowrite32(SR_200KSPS_R0, lp->clk_base_addr + CLK_CLK_CONF_REG_0);
-		iowrite32(SR_200KSPS_R2, lp->clk_base_addr + CLK_CLK_CONF_REG_2);
-	} else {
+	if (number > SAMPLE_RATE_2MSPS) {
 		return -EINVAL;
 	}
 
-	iowrite32(2, lp->clk_base_addr + CLK_CLK_CONF_REG_23); // use registers we just set instead of vivado generated settings
-	iowrite32(3, lp->clk_base_addr + CLK_CLK_CONF_REG_23); // apply
-
-	u32 clk_monitor_err_stat_reg = ioread32(lp->clk_base_addr + CLK_MONITOR_ERR_STAT_REG);
-
-	if (clk_monitor_err_stat_reg) {
-		printk("error configuring clock!");
-		printk("clk_monitor_err_stat_reg is %#010x\n", clk_monitor_err_stat_reg);
-		iowrite32(0, lp->clk_base_addr + CLK_CLK_CONF_REG_23); // fallback to vivado generated settings
-		iowrite32(1, lp->clk_base_addr + CLK_CLK_CONF_REG_23); // apply
+	int ret_rate = daqdrv_change_sample_rate(lp, daqdrv_sample_rate_hz(number));
+	if (ret_rate) {
+		return ret_rate;
 	}
 
 	return count;
@@ -199,190 +515,1834 @@ static ssize_t sampleRate_store(struct kobject *kobj, struct kobj_attribute *att
 
 static struct kobj_attribute sampleRate_attribute = __ATTR_WO(sampleRate);
 
-static irqreturn_t daqdrv_irq(int irq, void *lp)
+static ssize_t sampleRateHz_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
-	struct daqdrv_local *lpp = (struct daqdrv_local *)lp;
-	u32 availible = kfifo_iomod_avail(&(lpp->fifo));
+	struct daqdrv_local *lp = container_of(kobj, struct daqdrv_local, sampleRate_module_object);
+	return sysfs_emit(buf, "%u\n", lp->sample_rate_hz);
+}
 
-	if (lpp->allowed_to_read == false) {
-		return IRQ_HANDLED;
+static ssize_t sampleRateHz_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct daqdrv_local *lp = container_of(kobj, struct daqdrv_local, sampleRate_module_object);
+
+	u32 rate_hz;
+	int ret_conversion = kstrtou32(buf, 10, &rate_hz);
+	if (ret_conversion) {
+		return ret_conversion;
 	}
 
-	lpp->prev_overflowing = lpp->overflowing;
+	if (rate_hz < SAMPLE_RATE_MIN_HZ || rate_hz > SAMPLE_RATE_MAX_HZ) {
+		return -EINVAL;
+	}
 
-	if (availible < 4*FPGA_BUF_LEN) {
-		lpp->overflowing = true;
-	} else {
-		lpp->overflowing = false;
+	int ret_rate = daqdrv_change_sample_rate(lp, rate_hz);
+	if (ret_rate) {
+		return ret_rate;
 	}
 
-	if (lpp->overflowing == true && lpp->prev_overflowing == false) {
-		printk("Started overflowing! Dropping data, no space in fifo.\n");
+	return count;
+}
+
+static struct kobj_attribute sampleRateHz_attribute = __ATTR_RW(sampleRateHz);
+
+/*
+ * Replace the ring with one of the given size, the old content is lost.
+ * Only while nobody has the device open.
+ */
+static int daqdrv_ring_alloc(struct daqdrv_local *lp, unsigned int size)
+{
+	struct kfifo_iomod fifo;
+
+	int ret_fifo_alloc = kfifo_iomod_alloc(&fifo, size, GFP_KERNEL);
+	if (ret_fifo_alloc) {
+		return ret_fifo_alloc;
 	}
 
-	if (lpp->overflowing == false && lpp->prev_overflowing == true) {
-		printk("Stopped overflowing.\n");
+	kfifo_iomod_free(&(lp->fifo));
+	lp->fifo = fifo;
+	lp->ring_ctrl->size = kfifo_iomod_size(&(lp->fifo));
+	return 0;
+}
+
+static ssize_t ringSize_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct daqdrv_local *lp = container_of(kobj, struct daqdrv_local, sampleRate_module_object);
+	return sysfs_emit(buf, "%u\n", kfifo_iomod_size(&(lp->fifo)));
+}
+
+static ssize_t ringSize_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct daqdrv_local *lp = container_of(kobj, struct daqdrv_local, sampleRate_module_object);
+
+	unsigned int size;
+	int ret_conversion = kstrtouint(buf, 0, &size);
+	if (ret_conversion) {
+		return ret_conversion;
 	}
 
-	if (lpp->overflowing == false) {
-		kfifo_iomod_in(&(lpp->fifo), lpp->buffer_base_addr, 4*FPGA_BUF_LEN);
-		u32 stat_reg = ioread32(lpp->stat_base_addr);
+	if (size < RING_SIZE_MIN || size > RING_SIZE_MAX) {
+		return -EINVAL;
+	}
 
-		if (REG_GET_BIT(stat_reg, OVERWRITE_BIT)) {
-			printk("FPGA buffer might be overwritten, IRQ was too slow!");
-		}
+	mutex_lock(&(lp->open_mutex));
+	if (lp->open_count != 0) {
+		mutex_unlock(&(lp->open_mutex));
+		return -EBUSY;
 	}
+	int ret_alloc = daqdrv_ring_alloc(lp, size);
+	mutex_unlock(&(lp->open_mutex));
 
-	wake_up(&(lpp->wait_queue_head));
-	return IRQ_HANDLED;
+	if (ret_alloc) {
+		return ret_alloc;
+	}
+	return count;
 }
 
-static int daqdrv_open(struct inode *inode, struct file *file)
+static struct kobj_attribute ringSize_attribute = __ATTR_RW(ringSize);
+
+static ssize_t latencyBudgetMs_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
-	if (atomic_cmpxchg(&already_open, CDEV_NOT_USED, CDEV_EXCLUSIVE_OPEN))
-		return -EBUSY;
+	struct daqdrv_local *lp = container_of(kobj, struct daqdrv_local, sampleRate_module_object);
+	return sysfs_emit(buf, "%u\n", lp->latency_budget_ms);
+}
 
-	try_module_get(THIS_MODULE);
+static ssize_t latencyBudgetMs_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct daqdrv_local *lp = container_of(kobj, struct daqdrv_local, sampleRate_module_object);
 
-	struct daqdrv_local *lp = container_of(inode->i_cdev, struct daqdrv_local, chardev);
-	if (lp == NULL) {
-		printk("drv data is null\n");
-		return -ENOTRECOVERABLE;
+	u32 value;
+	int ret_conversion = kstrtou32(buf, 10, &value);
+	if (ret_conversion) {
+		return ret_conversion;
 	}
 
-	u32 ctrl_reg = ioread32(lp->ctrl_base_addr);
-	REG_SET_BIT(ctrl_reg, CLEAR_BIT_C);
-	iowrite32(ctrl_reg, lp->ctrl_base_addr);
-	REG_UNSET_BIT(ctrl_reg, CLEAR_BIT_C);
-	iowrite32(ctrl_reg, lp->ctrl_base_addr);
+	lp->latency_budget_ms = value;
+	return count;
+}
 
-	kfifo_iomod_reset_out(&(lp->fifo));
-	lp->overflowing = false;
-	lp->prev_overflowing = false;
+static struct kobj_attribute latencyBudgetMs_attribute = __ATTR_RW(latencyBudgetMs);
 
-	lp->allowed_to_read = true;
-	enable_irq(lp->irq);
-	
-	REG_SET_BIT(ctrl_reg, ADC_RUN_BIT);
-	REG_SET_BIT(ctrl_reg, DAC_RUN_BIT);
-	iowrite32(ctrl_reg, lp->ctrl_base_addr);
-	return 0;
+/*
+ * Smallest ring that holds latencyBudgetMs worth of data at the current
+ * sample rate, including block headers when they are enabled.
+ */
+static ssize_t ringSizeSuggested_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct daqdrv_local *lp = container_of(kobj, struct daqdrv_local, sampleRate_module_object);
+
+	u32 hdr_len = lp->block_headers ? sizeof(struct daqdrv_block_hdr) : 0;
+	u64 bytes = (u64)lp->sample_rate_hz * BYTES_PER_SAMPLE * lp->latency_budget_ms;
+	bytes = div_u64(bytes, 1000);
+	bytes = div_u64(bytes * (hdr_len + lp->seg_len), lp->seg_len);
+	bytes = clamp_t(u64, bytes, RING_SIZE_MIN, RING_SIZE_MAX);
+
+	return sysfs_emit(buf, "%lu\n", roundup_pow_of_two((unsigned long)bytes));
 }
 
-static int daqdrv_release(struct inode *inode, struct file *file)
+static struct kobj_attribute ringSizeSuggested_attribute = __ATTR_RO(ringSizeSuggested);
+
+static ssize_t irqOffMaxNs_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
-	if (inode->i_cdev == NULL) {
-		printk("can't find chardev\n");
-		return -ENOTRECOVERABLE;
+	struct daqdrv_local *lp = container_of(kobj, struct daqdrv_local, sampleRate_module_object);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(lp->irq_off_max_ns));
+}
+
+/* any write resets the maximum */
+static ssize_t irqOffMaxNs_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct daqdrv_local *lp = container_of(kobj, struct daqdrv_local, sampleRate_module_object);
+	WRITE_ONCE(lp->irq_off_max_ns, 0);
+	return count;
+}
+
+static struct kobj_attribute irqOffMaxNs_attribute = __ATTR_RW(irqOffMaxNs);
+
+static ssize_t blockHeaders_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct daqdrv_local *lp = container_of(kobj, struct daqdrv_local, sampleRate_module_object);
+	return sysfs_emit(buf, "%d\n", lp->block_headers);
+}
+
+static ssize_t blockHeaders_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct daqdrv_local *lp = container_of(kobj, struct daqdrv_local, sampleRate_module_object);
+
+	bool value;
+	int ret_conversion = kstrtobool(buf, &value);
+	if (ret_conversion) {
+		return ret_conversion;
 	}
 
-	struct daqdrv_local *lp = container_of(inode->i_cdev, struct daqdrv_local, chardev);
-	if (lp == NULL) {
-		printk("drv data is null");
-		return -ENOTRECOVERABLE;
+	// readers would lose track of the framing
+	mutex_lock(&(lp->open_mutex));
+	if (lp->open_count != 0) {
+		mutex_unlock(&(lp->open_mutex));
+		return -EBUSY;
 	}
-	
-	lp->allowed_to_read = false;
-	disable_irq(lp->irq);
-	
-	u32 ctrl_reg = ioread32(lp->ctrl_base_addr);
-	REG_UNSET_BIT(ctrl_reg, ADC_RUN_BIT);
-	REG_UNSET_BIT(ctrl_reg, DAC_RUN_BIT);
-	iowrite32(ctrl_reg, lp->ctrl_base_addr);
+	lp->block_headers = value;
+	if (value) {
+		lp->ring_ctrl->flags |= DAQDRV_RING_FLAG_BLOCK_HEADERS;
+	} else {
+		lp->ring_ctrl->flags &= ~DAQDRV_RING_FLAG_BLOCK_HEADERS;
+	}
+	mutex_unlock(&(lp->open_mutex));
+	return count;
+}
 
-	atomic_set(&already_open, CDEV_NOT_USED);
-	module_put(THIS_MODULE);
-	return 0;
+static struct kobj_attribute blockHeaders_attribute = __ATTR_RW(blockHeaders);
+
+#define DAQDRV_STAT_COUNTER(_name, _field) \
+static ssize_t _name##_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) \
+{ \
+	struct daqdrv_local *lp = container_of(kobj, struct daqdrv_local, sampleRate_module_object); \
+	return sysfs_emit(buf, "%lld\n", atomic64_read(&(lp->stats._field))); \
+} \
+static struct kobj_attribute _name##_attribute = __ATTR_RO(_name)
+
+DAQDRV_STAT_COUNTER(irqs, irqs);
+DAQDRV_STAT_COUNTER(blocksAccepted, blocks_accepted);
+DAQDRV_STAT_COUNTER(blocksDropped, blocks_dropped);
+DAQDRV_STAT_COUNTER(overwrites, overwrites);
+DAQDRV_STAT_COUNTER(bytesRead, bytes_read);
+DAQDRV_STAT_COUNTER(readerOverruns, reader_overruns);
+DAQDRV_STAT_COUNTER(dacUnderruns, dac_underruns);
+
+static ssize_t peakFill_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct daqdrv_local *lp = container_of(kobj, struct daqdrv_local, sampleRate_module_object);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(lp->stats.peak_fill));
 }
 
-static ssize_t daqdrv_read(struct file *filp, char __user *buffer, size_t length, loff_t *offset)
+// any write resets the peak
+static ssize_t peakFill_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
 {
-	if (filp->f_inode == NULL) {
-		printk("can't find inode\n");
-		return -ENOTRECOVERABLE;
+	struct daqdrv_local *lp = container_of(kobj, struct daqdrv_local, sampleRate_module_object);
+	WRITE_ONCE(lp->stats.peak_fill, 0);
+	return count;
+}
+
+static struct kobj_attribute peakFill_attribute = __ATTR_RW(peakFill);
+
+static ssize_t irqServiceMaxNs_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct daqdrv_local *lp = container_of(kobj, struct daqdrv_local, sampleRate_module_object);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(lp->stats.irq_service_max_ns));
+}
+
+// any write resets the maximum
+static ssize_t irqServiceMaxNs_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct daqdrv_local *lp = container_of(kobj, struct daqdrv_local, sampleRate_module_object);
+	WRITE_ONCE(lp->stats.irq_service_max_ns, 0);
+	return count;
+}
+
+static struct kobj_attribute irqServiceMaxNs_attribute = __ATTR_RW(irqServiceMaxNs);
+
+static struct attribute *daqdrv_stats_attrs[] = {
+	&irqs_attribute.attr,
+	&blocksAccepted_attribute.attr,
+	&blocksDropped_attribute.attr,
+	&overwrites_attribute.attr,
+	&bytesRead_attribute.attr,
+	&readerOverruns_attribute.attr,
+	&dacUnderruns_attribute.attr,
+	&peakFill_attribute.attr,
+	&irqServiceMaxNs_attribute.attr,
+	NULL,
+};
+
+static const struct attribute_group daqdrv_stats_group = {
+	.name = "statistics",
+	.attrs = daqdrv_stats_attrs,
+};
+
+static void daqdrv_lat_hist_add(struct daqdrv_lat_hist *hist, u64 ns)
+{
+	u32 bucket = ns ? min_t(u32, ilog2(ns), LAT_HIST_BUCKETS - 1) : 0;
+	atomic_inc(&(hist->buckets[bucket]));
+}
+
+static void daqdrv_lat_hist_reset(struct daqdrv_lat_hist *hist)
+{
+	for (int i = 0; i < LAT_HIST_BUCKETS; i++) {
+		atomic_set(&(hist->buckets[i]), 0);
+	}
+}
+
+static int daqdrv_lat_hist_show(struct seq_file *s, void *unused)
+{
+	struct daqdrv_lat_hist *hist = s->private;
+
+	seq_printf(s, "%12s %12s %10s\n", "from_ns", "to_ns", "count");
+	for (int i = 0; i < LAT_HIST_BUCKETS; i++) {
+		seq_printf(s, "%12llu %12llu %10u\n", i ? 1ULL << i : 0, (2ULL << i) - 1,
+			atomic_read(&(hist->buckets[i])));
 	}
+	return 0;
+}
+
+static int daqdrv_lat_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, daqdrv_lat_hist_show, inode->i_private);
+}
+
+// any write clears the histogram
+static ssize_t daqdrv_lat_hist_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	daqdrv_lat_hist_reset(s->private);
+	return count;
+}
+
+static const struct file_operations daqdrv_lat_hist_fops = {
+	.owner = THIS_MODULE,
+	.open = daqdrv_lat_hist_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.write = daqdrv_lat_hist_write,
+	.release = single_release,
+};
+
+static void daqdrv_copy_memcpy_fromio(void *dst, const void __iomem *src, size_t len)
+{
+	memcpy_fromio(dst, src, len);
+}
+
+/* one read per word, as wide as the BRAM port */
+static void daqdrv_copy_readl(void *dst, const void __iomem *src, size_t len)
+{
+	u32 *d = dst;
+
+	for (size_t i = 0; i < len / 4; i++) {
+		d[i] = __raw_readl(src + 4*i);
+	}
+}
+
+static const struct daqdrv_copy_strategy daqdrv_copy_strategies[] = {
+	{ .name = "memcpy_fromio", .copy = daqdrv_copy_memcpy_fromio, .hardirq = true },
+	{ .name = "readl", .copy = daqdrv_copy_readl, .hardirq = true },
+#if DAQDRV_HAVE_NEON
+	{ .name = "neon", .copy = daqdrv_neon_copy_fromio, .hardirq = false },
+#endif
+};
+
+/* the simulated FPGA always calls the hard IRQ handler */
+static bool daqdrv_copy_usable(struct daqdrv_local *lp, const struct daqdrv_copy_strategy *copy)
+{
+	return copy->hardirq || (threaded_irq && lp->sim == NULL);
+}
+
+#define COPY_BENCH_ROUNDS 32
+
+/* MB/s of copying the whole FPGA buffer into scratch */
+static u32 daqdrv_copy_bench(struct daqdrv_local *lp, const struct daqdrv_copy_strategy *copy, void *scratch)
+{
+	void __iomem *src = lp->buffer_base_addr;
+
+	u64 start = ktime_get_ns();
+	for (int i = 0; i < COPY_BENCH_ROUNDS; i++) {
+		copy->copy(scratch, src, 4*FPGA_BUF_LEN);
+	}
+	u64 ns = max_t(u64, ktime_get_ns() - start, 1);
+
+	// bytes per ns times 1000 is MB/s
+	return (u32)div64_u64((u64)COPY_BENCH_ROUNDS * 4*FPGA_BUF_LEN * 1000, ns);
+}
+
+/*
+ * Pick the copy strategy named by the copy_strategy parameter, or the
+ * fastest one.
+ */
+static void daqdrv_copy_init(struct device *dev, struct daqdrv_local *lp)
+{
+	lp->copy = &daqdrv_copy_strategies[0];
+
+	if (!sysfs_streq(copy_strategy, "auto")) {
+		for (int i = 0; i < ARRAY_SIZE(daqdrv_copy_strategies); i++) {
+			const struct daqdrv_copy_strategy *copy = &daqdrv_copy_strategies[i];
+			if (sysfs_streq(copy_strategy, copy->name) && daqdrv_copy_usable(lp, copy)) {
+				lp->copy = copy;
+				dev_info(dev, "copying FPGA blocks with %s\n", copy->name);
+				return;
+			}
+		}
+		dev_warn(dev, "copy strategy %s can't be used, picking the fastest\n", copy_strategy);
+	}
+
+	void *scratch = kmalloc(4*FPGA_BUF_LEN, GFP_KERNEL);
+	if (scratch == NULL) {
+		return;
+	}
+
+	u32 best = 0;
+	for (int i = 0; i < ARRAY_SIZE(daqdrv_copy_strategies); i++) {
+		const struct daqdrv_copy_strategy *copy = &daqdrv_copy_strategies[i];
+		if (!daqdrv_copy_usable(lp, copy)) {
+			continue;
+		}
+		u32 mbps = daqdrv_copy_bench(lp, copy, scratch);
+		if (mbps > best) {
+			best = mbps;
+			lp->copy = copy;
+		}
+	}
+	kfree(scratch);
+
+	dev_info(dev, "copying FPGA blocks with %s, %u MB/s\n", lp->copy->name, best);
+}
+
+/*
+ * Reading copy_bench runs the benchmark again. The acquisition may be
+ * running, the IRQ only ever reads the buffer as well.
+ */
+static int daqdrv_copy_bench_show(struct seq_file *s, void *unused)
+{
+	struct daqdrv_local *lp = s->private;
+
+	void *scratch = kmalloc(4*FPGA_BUF_LEN, GFP_KERNEL);
+	if (scratch == NULL) {
+		return -ENOMEM;
+	}
+
+	for (int i = 0; i < ARRAY_SIZE(daqdrv_copy_strategies); i++) {
+		const struct daqdrv_copy_strategy *copy = &daqdrv_copy_strategies[i];
+		char mark = (copy == READ_ONCE(lp->copy)) ? '*' : ' ';
+		if (daqdrv_copy_usable(lp, copy)) {
+			seq_printf(s, "%c %-14s %6u MB/s\n", mark, copy->name, daqdrv_copy_bench(lp, copy, scratch));
+		} else {
+			seq_printf(s, "%c %-14s      - MB/s\n", mark, copy->name);
+		}
+	}
+
+	kfree(scratch);
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(daqdrv_copy_bench);
+
+static int daqdrv_copy_strategy_show(struct seq_file *s, void *unused)
+{
+	struct daqdrv_local *lp = s->private;
+	seq_printf(s, "%s\n", READ_ONCE(lp->copy)->name);
+	return 0;
+}
+
+static int daqdrv_copy_strategy_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, daqdrv_copy_strategy_show, inode->i_private);
+}
+
+static ssize_t daqdrv_copy_strategy_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct daqdrv_local *lp = s->private;
+	char name[32];
+
+	if (count >= sizeof(name)) {
+		return -EINVAL;
+	}
+	if (copy_from_user(name, buf, count)) {
+		return -EFAULT;
+	}
+	name[count] = '\0';
+
+	for (int i = 0; i < ARRAY_SIZE(daqdrv_copy_strategies); i++) {
+		const struct daqdrv_copy_strategy *copy = &daqdrv_copy_strategies[i];
+		if (sysfs_streq(name, copy->name)) {
+			if (!daqdrv_copy_usable(lp, copy)) {
+				return -EOPNOTSUPP;
+			}
+			WRITE_ONCE(lp->copy, copy);
+			return count;
+		}
+	}
+	return -EINVAL;
+}
+
+static const struct file_operations daqdrv_copy_strategy_fops = {
+	.owner = THIS_MODULE,
+	.open = daqdrv_copy_strategy_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.write = daqdrv_copy_strategy_write,
+	.release = single_release,
+};
+
+static void daqdrv_debugfs_init(struct daqdrv_local *lp)
+{
+	daqdrv_lat_hist_reset(&(lp->lat_irq_service));
+	daqdrv_lat_hist_reset(&(lp->lat_irq_to_wakeup));
+	daqdrv_lat_hist_reset(&(lp->lat_wakeup_to_read));
+	atomic64_set(&(lp->last_irq_ns), 0);
+
+	lp->debugfs_dir = debugfs_create_dir(lp->name, NULL);
+	debugfs_create_file("irq_service_ns", 0600, lp->debugfs_dir, &(lp->lat_irq_service), &daqdrv_lat_hist_fops);
+	debugfs_create_file("irq_to_wakeup_ns", 0600, lp->debugfs_dir, &(lp->lat_irq_to_wakeup), &daqdrv_lat_hist_fops);
+	debugfs_create_file("wakeup_to_read_ns", 0600, lp->debugfs_dir, &(lp->lat_wakeup_to_read), &daqdrv_lat_hist_fops);
+	debugfs_create_file("copy_bench", 0400, lp->debugfs_dir, lp, &daqdrv_copy_bench_fops);
+	debugfs_create_file("copy_strategy", 0600, lp->debugfs_dir, lp, &daqdrv_copy_strategy_fops);
+}
+
+/*
+ * A reader noticed new data, in poll() or by waking up in read().
+ */
+static void daqdrv_reader_woken(struct daqdrv_local *lp, struct daqdrv_reader *reader)
+{
+	if (reader->wake_ns != 0) {
+		return;
+	}
+
+	u64 now = ktime_get_ns();
+	u64 irq_ns = atomic64_read(&(lp->last_irq_ns));
+	if (irq_ns != 0) {
+		daqdrv_lat_hist_add(&(lp->lat_irq_to_wakeup), now - irq_ns);
+	}
+	reader->wake_ns = now;
+}
+
+static void daqdrv_ring_reset(struct daqdrv_local *lp)
+{
+	kfifo_iomod_reset_out(&(lp->fifo));
+	lp->ring_ctrl->producer = lp->fifo.kfifo_iomod.in;
+	lp->ring_ctrl->tail = lp->fifo.kfifo_iomod.out;
+	lp->ring_ctrl->rate_pos = lp->fifo.kfifo_iomod.in;
+}
+
+/*
+ * Make room for one record by retiring the oldest ones. The ring is shared
+ * by all readers and never waits for them, a reader that was still on a
+ * retired block notices in daqdrv_reader_catch_up(). The new tail is
+ * published before the space is overwritten, see daqdrv_read().
+ */
+static void daqdrv_ring_retire(struct daqdrv_local *lp, u32 rec_len)
+{
+	struct __kfifo_iomod *fifo = &(lp->fifo.kfifo_iomod);
+
+	if (kfifo_iomod_avail(&(lp->fifo)) >= rec_len) {
+		return;
+	}
+
+	// records are all the same size, so out stays on a record boundary
+	u32 out = fifo->out;
+	while (fifo->in - out + rec_len > kfifo_iomod_size(&(lp->fifo))) {
+		out += rec_len;
+	}
+
+	WRITE_ONCE(fifo->out, out);
+	WRITE_ONCE(lp->ring_ctrl->tail, out);
+	smp_wmb();
+}
+
+/*
+ * Move a reader whose data was retired to the oldest block still in the ring.
+ */
+static void daqdrv_reader_catch_up(struct daqdrv_local *lp, struct daqdrv_reader *reader)
+{
+	u32 tail = READ_ONCE(lp->fifo.kfifo_iomod.out);
+
+	if ((s32)(tail - reader->cursor) > 0) {
+		printk_ratelimited("Reader too slow, skipping %u bytes.\n", tail - reader->cursor);
+		if (reader->overflowing == false) {
+			trace_daqdrv_overflow_start(reader, tail - reader->cursor);
+			reader->overflowing = true;
+			reader->overflow_bytes = 0;
+		}
+		reader->overflow_bytes += tail - reader->cursor;
+		reader->overruns++;
+		reader->lost_bytes += tail - reader->cursor;
+		atomic64_inc(&(lp->stats.reader_overruns));
+		reader->cursor = tail;
+	}
+}
+
+/*
+ * Number of bytes a reader can take right now, rounded down to whole words.
+ */
+static u32 daqdrv_readable(struct daqdrv_local *lp, struct daqdrv_reader *reader)
+{
+	u32 in = smp_load_acquire(&(lp->fifo.kfifo_iomod.in));
+	u32 len = in - reader->cursor;
+
+	// an overrun reader continues at the tail
+	if (len > kfifo_iomod_size(&(lp->fifo))) {
+		len = in - READ_ONCE(lp->fifo.kfifo_iomod.out);
+	}
+	return len - (len % 4);
+}
+
+static void daqdrv_irq_off_time(struct daqdrv_local *lp, u64 start)
+{
+	u32 duration = (u32)(ktime_get_ns() - start);
+
+	if (duration > lp->irq_off_max_ns) {
+		WRITE_ONCE(lp->irq_off_max_ns, duration);
+	}
+}
+
+/*
+ * Commit a block whose data is already in the fifo. stat_reg holds status
+ * bits latched before the copy, the status register is read again to catch
+ * overwrites that happened during the copy. The header goes in last, so it
+ * can carry them.
+ */
+static void daqdrv_block_done(struct daqdrv_local *lp, u32 stat_reg)
+{
+	u32 hdr_len = lp->block_headers ? sizeof(struct daqdrv_block_hdr) : 0;
+	stat_reg |= ioread32(lp->stat_base_addr);
+
+	if (REG_GET_BIT(stat_reg, OVERWRITE_BIT)) {
+		printk("FPGA buffer might be overwritten, IRQ was too slow!");
+		trace_daqdrv_overwrite(lp->block_hdr.sequence, stat_reg);
+		lp->block_hdr.flags |= DAQDRV_BLOCK_FLAG_OVERWRITE;
+		atomic64_inc(&(lp->stats.overwrites));
+	}
+
+	if (hdr_len != 0) {
+		kfifo_iomod_in_mem_at(&(lp->fifo), &(lp->block_hdr), hdr_len, 0);
+	}
+	kfifo_iomod_in_commit(&(lp->fifo), hdr_len + lp->block_hdr.length);
+	smp_store_release(&(lp->ring_ctrl->producer), lp->fifo.kfifo_iomod.in);
+
+	atomic64_inc(&(lp->stats.blocks_accepted));
+
+	u32 service = (u32)(ktime_get_ns() - lp->block_hdr.timestamp_ns);
+	if (service > lp->stats.irq_service_max_ns) {
+		WRITE_ONCE(lp->stats.irq_service_max_ns, service);
+	}
+	daqdrv_lat_hist_add(&(lp->lat_irq_service), service);
+	atomic64_set(&(lp->last_irq_ns), lp->block_hdr.timestamp_ns);
+}
+
+static void daqdrv_dma_done(void *param, const struct dmaengine_result *result)
+{
+	struct daqdrv_local *lp = (struct daqdrv_local *)param;
+
+	dma_unmap_sg(lp->dma_chan->device->dev, lp->dma_sgl, lp->dma_nents, DMA_FROM_DEVICE);
+
+	if (result->result == DMA_TRANS_NOERROR) {
+		daqdrv_block_done(lp, lp->dma_stat);
+	} else {
+		printk_ratelimited("DMA transfer failed with %d, dropping FPGA block.\n", result->result);
+		atomic64_inc(&(lp->stats.blocks_dropped));
+	}
+
+	smp_store_release(&(lp->dma_busy), false);
+	wake_up_interruptible(&(lp->wait_queue_head));
+}
+
+/*
+ * Queue the transfer of one block from the FPGA buffer straight into the
+ * fifo pages, daqdrv_dma_done() publishes it. Returns false if the transfer
+ * couldn't be set up, the caller copies the block with the CPU instead.
+ */
+static bool daqdrv_dma_start(struct daqdrv_local *lp, u32 src_off, u32 len, u32 hdr_len, u32 stat_reg)
+{
+	struct device *dma_dev = lp->dma_chan->device->dev;
+
+	sg_init_table(lp->dma_sgl, DMA_SGL_LEN);
+	int nents = kfifo_iomod_dma_in_prepare_at(&(lp->fifo), lp->dma_sgl, DMA_SGL_LEN, len, hdr_len);
+	if (nents == 0) {
+		return false;
+	}
+
+	int mapped = dma_map_sg(dma_dev, lp->dma_sgl, nents, DMA_FROM_DEVICE);
+	if (mapped == 0) {
+		return false;
+	}
+
+	lp->dma_nents = nents;
+	lp->dma_stat = stat_reg;
+
+	dma_addr_t src = lp->dma_src + src_off;
+	struct scatterlist *sg;
+	int i;
+
+	for_each_sg(lp->dma_sgl, sg, mapped, i) {
+		unsigned long flags = DMA_CTRL_ACK;
+		if (i == mapped - 1) {
+			flags |= DMA_PREP_INTERRUPT;
+		}
+
+		struct dma_async_tx_descriptor *desc = dmaengine_prep_dma_memcpy(lp->dma_chan,
+			sg_dma_address(sg), src, sg_dma_len(sg), flags);
+		if (desc == NULL) {
+			goto error;
+		}
+
+		if (i == mapped - 1) {
+			desc->callback_result = daqdrv_dma_done;
+			desc->callback_param = lp;
+		}
+
+		if (dma_submit_error(dmaengine_submit(desc))) {
+			goto error;
+		}
+		src += sg_dma_len(sg);
+	}
+
+	lp->dma_busy = true;
+	dma_async_issue_pending(lp->dma_chan);
+	return true;
+error:
+	dmaengine_terminate_async(lp->dma_chan);
+	dma_unmap_sg(dma_dev, lp->dma_sgl, nents, DMA_FROM_DEVICE);
+	return false;
+}
+
+/*
+ * Move one block from the FPGA buffer into the fifo and wake up readers.
+ * seq and time_ns identify the interrupt that announced the block, blocks
+ * that are dropped leave a gap in seq that the next header reports. Returns
+ * the bytes copied or handed to DMA, 0 if the block was dropped.
+ */
+static u32 daqdrv_drain_block(struct daqdrv_local *lpp, u64 seq, u64 time_ns, u32 stat_reg)
+{
+	// the fifo can't be touched until the previous transfer is done
+	if (lpp->dma_chan != NULL && smp_load_acquire(&(lpp->dma_busy))) {
+		printk_ratelimited("DMA still busy, dropping FPGA block.\n");
+		atomic64_inc(&(lpp->stats.blocks_dropped));
+		return 0;
+	}
+
+	// interrupts announce the segments in turn, dropped ones included
+	u32 seg_len = lpp->seg_len;
+	u32 seg_off = ((u32)(seq - lpp->seg_seq0) & (lpp->segments - 1)) * seg_len;
+
+	u32 hdr_len = lpp->block_headers ? sizeof(struct daqdrv_block_hdr) : 0;
+	u32 rec_len = hdr_len + seg_len;
+
+	daqdrv_ring_retire(lpp, rec_len);
+
+	struct daqdrv_block_hdr *hdr = &(lpp->block_hdr);
+	u64 dropped = seq - lpp->next_seq;
+
+	hdr->magic = DAQDRV_BLOCK_MAGIC;
+	hdr->length = seg_len;
+	hdr->sequence = seq;
+	hdr->timestamp_ns = time_ns;
+	hdr->flags = dropped ? DAQDRV_BLOCK_FLAG_DROPPED : 0;
+	hdr->dropped = (u32)min_t(u64, dropped, U32_MAX);
+	hdr->sample_rate_hz = lpp->sample_rate_hz;
+	hdr->__reserved = 0;
+	if (lpp->rate_changed) {
+		hdr->flags |= DAQDRV_BLOCK_FLAG_RATE_CHANGE;
+		lpp->rate_changed = false;
+	}
+	lpp->next_seq = seq + 1;
+
+	if (lpp->dma_chan != NULL && daqdrv_dma_start(lpp, seg_off, seg_len, hdr_len, stat_reg)) {
+		return rec_len;
+	}
+
+	const struct daqdrv_copy_strategy *copy = READ_ONCE(lpp->copy);
+	kfifo_iomod_in_at_copy(&(lpp->fifo), lpp->buffer_base_addr + seg_off, seg_len, hdr_len, copy->copy);
+	daqdrv_block_done(lpp, stat_reg);
+
+	wake_up_interruptible(&(lpp->wait_queue_head));
+	return rec_len;
+}
+
+/*
+ * Bytes of the output ring not played yet, in whole words. producer may be
+ * written by userspace, a bogus one only ever makes the DAC play garbage.
+ */
+static u32 daqdrv_dac_fill(struct daqdrv_local *lp)
+{
+	u32 fill = smp_load_acquire(&(lp->dac_ctrl->producer)) - READ_ONCE(lp->dac_consumer);
+	fill = min_t(u32, fill, lp->dac_ring_size);
+	return fill - (fill % 4);
+}
+
+/* copy len bytes of the output ring at pos into the DAC buffer at dst_off */
+static void daqdrv_dac_copy_out(struct daqdrv_local *lp, u32 dst_off, u32 pos, u32 len)
+{
+	u32 off = pos & (lp->dac_ring_size - 1);
+	u32 first = min_t(u32, len, lp->dac_ring_size - off);
+
+	memcpy_toio(lp->dac_base_addr + dst_off, lp->dac_ring + off, first);
+	memcpy_toio(lp->dac_base_addr + dst_off + first, lp->dac_ring, len - first);
+}
+
+static void daqdrv_dac_consume(struct daqdrv_local *lp, u32 len)
+{
+	u32 consumer = lp->dac_consumer + len;
+	smp_store_release(&(lp->dac_consumer), consumer);
+	WRITE_ONCE(lp->dac_ctrl->consumer, consumer);
+}
+
+/*
+ * Refill the segment of the DAC buffer that was just played, the one the
+ * interrupt seq announced for the ADC. Nothing to do in loop mode.
+ */
+static void daqdrv_dac_refill(struct daqdrv_local *lp, u64 seq)
+{
+	if (lp->dac_base_addr == NULL) {
+		return;
+	}
+
+	unsigned long flags;
+	spin_lock_irqsave(&(lp->dac_lock), flags);
+
+	if (lp->dac_loop_len != 0) {
+		spin_unlock_irqrestore(&(lp->dac_lock), flags);
+		return;
+	}
+
+	u32 seg_len = lp->seg_len;
+	u32 seg_off = ((u32)(seq - lp->seg_seq0) & (lp->segments - 1)) * seg_len;
+	u32 consumer = lp->dac_consumer;
+	u32 len = min_t(u32, daqdrv_dac_fill(lp), seg_len);
+
+	if (len != 0) {
+		daqdrv_dac_copy_out(lp, seg_off, consumer, len);
+		lp->dac_last_word = *(u32 *)(lp->dac_ring + ((consumer + len - 4) & (lp->dac_ring_size - 1)));
+		lp->dac_streaming = true;
+		daqdrv_dac_consume(lp, len);
+	}
+
+	// the output holds its level until there is data again
+	if (len < seg_len) {
+		for (u32 off = len; off < seg_len; off += 4) {
+			__raw_writel(lp->dac_last_word, lp->dac_base_addr + seg_off + off);
+		}
+		if (lp->dac_streaming) {
+			atomic64_inc(&(lp->stats.dac_underruns));
+			WRITE_ONCE(lp->dac_ctrl->underruns, atomic64_read(&(lp->stats.dac_underruns)));
+		}
+	}
+
+	spin_unlock_irqrestore(&(lp->dac_lock), flags);
+
+	if (len != 0) {
+		wake_up_interruptible(&(lp->wait_queue_head));
+	}
+}
+
+/*
+ * Loop len bytes taken off the output ring, or go back to playing the ring
+ * with len 0. Called with open_mutex held.
+ */
+static int daqdrv_dac_set_loop(struct daqdrv_local *lp, u32 len)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&(lp->dac_lock), flags);
+
+	if (len != 0) {
+		if (daqdrv_dac_fill(lp) < len) {
+			spin_unlock_irqrestore(&(lp->dac_lock), flags);
+			return -ENODATA;
+		}
+		daqdrv_dac_copy_out(lp, 0, lp->dac_consumer, len);
+		daqdrv_dac_consume(lp, len);
+	}
+
+	lp->dac_loop_len = len;
+	iowrite32(len / 4, lp->ctrl_base_addr + DAC_LEN_REG);
+	WRITE_ONCE(lp->dac_ctrl->loop_len, len);
+	WRITE_ONCE(lp->dac_ctrl->flags, len != 0 ? DAQDRV_DAC_FLAG_LOOP : 0);
+
+	spin_unlock_irqrestore(&(lp->dac_lock), flags);
+
+	wake_up_interruptible(&(lp->wait_queue_head));
+	return 0;
+}
+
+/*
+ * Empty the output ring and silence the DAC buffer, when the acquisition
+ * starts over. The interrupt is off. Called with open_mutex held.
+ */
+static void daqdrv_dac_reset(struct daqdrv_local *lp)
+{
+	if (lp->dac_base_addr == NULL) {
+		return;
+	}
+
+	mutex_lock(&(lp->dac_mutex));
+	daqdrv_dac_set_loop(lp, 0);
+	lp->dac_consumer = 0;
+	lp->dac_ctrl->consumer = 0;
+	lp->dac_ctrl->producer = 0;
+	lp->dac_last_word = 0;
+	lp->dac_streaming = false;
+	memset_io(lp->dac_base_addr, 0, 4*FPGA_BUF_LEN);
+	mutex_unlock(&(lp->dac_mutex));
+}
+
+static irqreturn_t daqdrv_irq(int irq, void *lp)
+{
+	struct daqdrv_local *lpp = (struct daqdrv_local *)lp;
+	u64 start = ktime_get_ns();
+
+	atomic64_inc(&(lpp->stats.irqs));
+
+	if (lpp->allowed_to_read == false) {
+		return IRQ_HANDLED;
+	}
+
+	u64 seq = lpp->irq_seq++;
+	trace_daqdrv_irq_entry(seq, false);
+	u32 bytes = daqdrv_drain_block(lpp, seq, start, 0);
+	daqdrv_dac_refill(lpp, seq);
+	trace_daqdrv_irq_exit(seq, false, bytes, kfifo_iomod_len(&(lpp->fifo)));
+	daqdrv_irq_off_time(lpp, start);
+	return IRQ_HANDLED;
+}
+
+/*
+ * Top half of the threaded mode, it only latches the status, the time and
+ * the sequence number of the interrupt for the thread.
+ */
+static irqreturn_t daqdrv_irq_top(int irq, void *lp)
+{
+	struct daqdrv_local *lpp = (struct daqdrv_local *)lp;
+	u64 start = ktime_get_ns();
+
+	atomic64_inc(&(lpp->stats.irqs));
+
+	if (lpp->allowed_to_read == false) {
+		return IRQ_HANDLED;
+	}
+
+	spin_lock(&(lpp->irq_lock));
+	u64 seq = lpp->irq_seq;
+	trace_daqdrv_irq_entry(seq, false);
+	lpp->irq_stat |= ioread32(lpp->stat_base_addr);
+	lpp->irq_time_ns = start;
+	lpp->irq_seq++;
+	spin_unlock(&(lpp->irq_lock));
+	trace_daqdrv_irq_exit(seq, false, 0, kfifo_iomod_len(&(lpp->fifo)));
+
+	daqdrv_irq_off_time(lpp, start);
+	return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t daqdrv_irq_thread(int irq, void *lp)
+{
+	struct daqdrv_local *lpp = (struct daqdrv_local *)lp;
+
+	// the IRQ core creates the thread, so the priority is set from inside it
+	if (lpp->thread_prio_set == false) {
+		struct sched_attr attr = {
+			.size = sizeof(struct sched_attr),
+			.sched_policy = SCHED_FIFO,
+			.sched_priority = irq_thread_prio,
+		};
+		int ret_sched = sched_setattr_nocheck(current, &attr);
+		if (ret_sched) {
+			printk("Setting IRQ thread priority %d failed with %d\n", irq_thread_prio, ret_sched);
+		}
+		lpp->thread_prio_set = true;
+	}
+
+	spin_lock_irq(&(lpp->irq_lock));
+	u64 seq = lpp->irq_seq - 1;
+	u64 time_ns = lpp->irq_time_ns;
+	u32 stat_reg = lpp->irq_stat;
+	lpp->irq_stat = 0;
+	spin_unlock_irq(&(lpp->irq_lock));
+
+	trace_daqdrv_irq_entry(seq, true);
+
+	// wakeups that arrive while the thread runs are merged into one
+	u64 missed = seq - lpp->thread_next_seq;
+	if (missed != 0) {
+		printk_ratelimited("IRQ thread too slow, %llu FPGA blocks were lost.\n", missed);
+		atomic64_add(missed, &(lpp->stats.blocks_dropped));
+	}
+	lpp->thread_next_seq = seq + 1;
+
+	u32 bytes = daqdrv_drain_block(lpp, seq, time_ns, stat_reg);
+
+	// the DAC played the missed segments too, the newest ones still need data
+	for (u64 s = seq - min_t(u64, missed, lpp->segments - 1); s != seq + 1; s++) {
+		daqdrv_dac_refill(lpp, s);
+	}
+
+	trace_daqdrv_irq_exit(seq, true, bytes, kfifo_iomod_len(&(lpp->fifo)));
+	return IRQ_HANDLED;
+}
+
+/* drop whatever the FPGA has buffered so far */
+static void daqdrv_clear_fpga(struct daqdrv_local *lp)
+{
+	u32 ctrl_reg = ioread32(lp->ctrl_base_addr);
+	REG_SET_BIT(ctrl_reg, CLEAR_BIT_C);
+	iowrite32(ctrl_reg, lp->ctrl_base_addr);
+	REG_UNSET_BIT(ctrl_reg, CLEAR_BIT_C);
+	iowrite32(ctrl_reg, lp->ctrl_base_addr);
+
+	// the FPGA starts over with segment 0
+	lp->seg_seq0 = lp->irq_seq;
+}
+
+/*
+ * Start the acquisition. With reset the ring and the block sequence numbers
+ * start over, which is only allowed when no reader has a position in the ring
+ * the caller can't fix up. Called with open_mutex held.
+ */
+static void daqdrv_start(struct daqdrv_local *lp, bool reset)
+{
+	if (reset) {
+		daqdrv_ring_reset(lp);
+		lp->irq_seq = 0;
+		lp->thread_next_seq = 0;
+		lp->next_seq = 0;
+		lp->rate_changed = false;
+		daqdrv_dac_reset(lp);
+	}
+	daqdrv_clear_fpga(lp);
+	lp->irq_stat = 0;
+
+	lp->allowed_to_read = true;
+	if (lp->sim != NULL) {
+		lp->sim->start(lp->sim, &daqdrv_irq, lp);
+	} else {
+		enable_irq(lp->irq);
+	}
+
+	u32 ctrl_reg = ioread32(lp->ctrl_base_addr);
+	REG_SET_BIT(ctrl_reg, ADC_RUN_BIT);
+	REG_SET_BIT(ctrl_reg, DAC_RUN_BIT);
+	iowrite32(ctrl_reg, lp->ctrl_base_addr);
+}
+
+/* Called with open_mutex held. */
+static void daqdrv_stop(struct daqdrv_local *lp)
+{
+	lp->allowed_to_read = false;
+	if (lp->sim != NULL) {
+		lp->sim->stop(lp->sim);
+	} else {
+		disable_irq(lp->irq);
+	}
+
+	// a terminated transfer never calls back, so clean up after it here
+	if (lp->dma_chan != NULL) {
+		dmaengine_terminate_sync(lp->dma_chan);
+		if (lp->dma_busy) {
+			dma_unmap_sg(lp->dma_chan->device->dev, lp->dma_sgl, lp->dma_nents, DMA_FROM_DEVICE);
+			lp->dma_busy = false;
+		}
+	}
+
+	u32 ctrl_reg = ioread32(lp->ctrl_base_addr);
+	REG_UNSET_BIT(ctrl_reg, ADC_RUN_BIT);
+	REG_UNSET_BIT(ctrl_reg, DAC_RUN_BIT);
+	iowrite32(ctrl_reg, lp->ctrl_base_addr);
+}
+
+/*
+ * Pause the ADC of a running acquisition and wait until the block that is
+ * being copied is in the fifo. The interrupt stays enabled. Called with
+ * open_mutex held.
+ */
+static void daqdrv_pause(struct daqdrv_local *lp)
+{
+	u32 ctrl_reg = ioread32(lp->ctrl_base_addr);
+	REG_UNSET_BIT(ctrl_reg, ADC_RUN_BIT);
+	iowrite32(ctrl_reg, lp->ctrl_base_addr);
+
+	if (lp->sim != NULL) {
+		lp->sim->stop(lp->sim);
+	} else {
+		synchronize_irq(lp->irq);
+	}
+
+	if (lp->dma_chan != NULL) {
+		bool busy;
+		int ret_dma = read_poll_timeout(smp_load_acquire, busy, busy == false, 20, 20000, false, &(lp->dma_busy));
+		if (ret_dma) {
+			printk("DMA transfer didn't finish while pausing the ADC, dropping it.\n");
+			dmaengine_terminate_sync(lp->dma_chan);
+			if (lp->dma_busy) {
+				dma_unmap_sg(lp->dma_chan->device->dev, lp->dma_sgl, lp->dma_nents, DMA_FROM_DEVICE);
+				lp->dma_busy = false;
+			}
+		}
+	}
+}
+
+/*
+ * Let the ADC run again after daqdrv_pause(). Whatever the FPGA buffered
+ * before the pause is dropped, there is no telling how much of it is valid.
+ */
+static void daqdrv_resume(struct daqdrv_local *lp)
+{
+	daqdrv_clear_fpga(lp);
+	lp->irq_stat = 0;
+
+	if (lp->sim != NULL) {
+		lp->sim->start(lp->sim, &daqdrv_irq, lp);
+	}
+	u32 ctrl_reg = ioread32(lp->ctrl_base_addr);
+	REG_SET_BIT(ctrl_reg, ADC_RUN_BIT);
+	iowrite32(ctrl_reg, lp->ctrl_base_addr);
+}
+
+/*
+ * Change the sample rate of a running acquisition. The first block at the
+ * new rate is flagged with DAQDRV_BLOCK_FLAG_RATE_CHANGE and its position is
+ * published in ring_ctrl->rate_pos. Readers keep their positions. Called
+ * with open_mutex held.
+ */
+static int daqdrv_switch_rate(struct daqdrv_local *lp, u32 rate_hz)
+{
+	daqdrv_pause(lp);
+
+	u32 old_rate_hz = lp->sample_rate_hz;
+	int ret_rate = daqdrv_set_sample_rate(lp, rate_hz);
+
+	// no block is being added, so in is where the new rate starts. A failed
+	// lock falls back to the default rate, which is a change too.
+	if (ret_rate >= 0 || lp->sample_rate_hz != old_rate_hz) {
+		lp->rate_changed = true;
+		smp_store_release(&(lp->ring_ctrl->rate_pos), lp->fifo.kfifo_iomod.in);
+	}
+
+	daqdrv_resume(lp);
+	return ret_rate;
+}
+
+static u32 daqdrv_round_segments(struct daqdrv_local *lp, u32 segments)
+{
+	return rounddown_pow_of_two(clamp_t(u32, segments, 1, lp->max_segments));
+}
+
+/*
+ * Split the FPGA buffer into the given number of segments, rounded down to
+ * what the bitstream supports. Returns the number that was set. The ring
+ * starts over when the block size changes, daqdrv_ring_retire() relies on all
+ * records having the same size. Called with open_mutex held.
+ */
+static u32 daqdrv_set_segments(struct daqdrv_local *lp, u32 segments)
+{
+	segments = daqdrv_round_segments(lp, segments);
+	if (segments == lp->segments) {
+		return segments;
+	}
+
+	bool running = lp->allowed_to_read;
+	if (running) {
+		daqdrv_pause(lp);
+	}
+	daqdrv_ring_reset(lp);
+
+	u32 ctrl_reg = ioread32(lp->ctrl_base_addr);
+	ctrl_reg &= ~(SEGMENTS_MASK << SEGMENTS_SHIFT);
+	ctrl_reg |= ilog2(segments) << SEGMENTS_SHIFT;
+	iowrite32(ctrl_reg, lp->ctrl_base_addr);
+
+	lp->segments = segments;
+	lp->seg_len = 4*FPGA_BUF_LEN / segments;
+	WRITE_ONCE(lp->ring_ctrl->block_size, lp->seg_len);
+	if (lp->dac_ctrl != NULL) {
+		WRITE_ONCE(lp->dac_ctrl->block_size, lp->seg_len);
+	}
+
+	if (running) {
+		daqdrv_resume(lp);
+	}
+	return segments;
+}
+
+static int daqdrv_open(struct inode *inode, struct file *file)
+{
+	try_module_get(THIS_MODULE);
+
+	struct daqdrv_local *lp = container_of(inode->i_cdev, struct daqdrv_local, chardev);
+	if (lp == NULL) {
+		printk("drv data is null\n");
+		return -ENOTRECOVERABLE;
+	}
+
+	struct daqdrv_reader *reader = kzalloc(sizeof(struct daqdrv_reader), GFP_KERNEL);
+	if (reader == NULL) {
+		module_put(THIS_MODULE);
+		return -ENOMEM;
+	}
+	mutex_init(&(reader->read_mutex));
+	reader->watermark = DAQDRV_WATERMARK_DEFAULT;
+	file->private_data = reader;
+
+	mutex_lock(&(lp->open_mutex));
+
+	// the first reader starts the acquisition, the others join it
+	if (lp->open_count == 0) {
+		daqdrv_start(lp, true);
+	}
+	lp->open_count++;
+
+	// new readers start with the next block, not with old data
+	reader->cursor = smp_load_acquire(&(lp->fifo.kfifo_iomod.in));
+
+	mutex_unlock(&(lp->open_mutex));
+	return 0;
+}
+
+static int daqdrv_release(struct inode *inode, struct file *file)
+{
+	if (inode->i_cdev == NULL) {
+		printk("can't find chardev\n");
+		return -ENOTRECOVERABLE;
+	}
+
+	struct daqdrv_local *lp = container_of(inode->i_cdev, struct daqdrv_local, chardev);
+	if (lp == NULL) {
+		printk("drv data is null");
+		return -ENOTRECOVERABLE;
+	}
+
+	mutex_lock(&(lp->open_mutex));
+
+	lp->open_count--;
+	if (lp->open_count == 0 && lp->allowed_to_read == true) {
+		daqdrv_stop(lp);
+	}
+
+	mutex_unlock(&(lp->open_mutex));
+
+	kfree(file->private_data);
+	file->private_data = NULL;
+
+	module_put(THIS_MODULE);
+	return 0;
+}
+
+static ssize_t daqdrv_do_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *filp = iocb->ki_filp;
+
+	if (filp->f_inode == NULL) {
+		printk("can't find inode\n");
+		return -ENOTRECOVERABLE;
+	}
+
+	if (filp->f_inode->i_cdev == NULL) {
+		printk("can't find chardev\n");
+		return -ENOTRECOVERABLE;
+	}
+
+	struct daqdrv_local *lp = container_of(filp->f_inode->i_cdev, struct daqdrv_local, chardev);
+	if (lp == NULL) {
+		printk("drv data is null\n");
+		return -ENOTRECOVERABLE;
+	}
+
+	struct daqdrv_reader *reader = filp->private_data;
+	size_t length = iov_iter_count(to);
+	size_t wanted = length - (length % 4);
+
+	if (wanted == 0) {
+		return -EINVAL;
+	}
+
+	if (mutex_lock_interruptible(&(reader->read_mutex))) {
+		return -ERESTARTSYS;
+	}
+
+	/*
+	 * Blocking readers sleep until the watermark is reached, or until
+	 * there is enough data to fill the whole request.
+	 */
+	if ((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)) {
+		if (daqdrv_readable(lp, reader) == 0) {
+			mutex_unlock(&(reader->read_mutex));
+			return -EAGAIN;
+		}
+	} else {
+		u32 threshold = min_t(size_t, reader->watermark, wanted);
+		bool must_wait = daqdrv_readable(lp, reader) < threshold;
+		// the ioctls of this file take the lock too, it isn't held while
+		// sleeping, and the cursor they may have moved is looked at again
+		while (daqdrv_readable(lp, reader) < threshold) {
+			mutex_unlock(&(reader->read_mutex));
+			int ret_wait = wait_event_interruptible(lp->wait_queue_head,
+				daqdrv_readable(lp, reader) >= threshold);
+			if (ret_wait) {
+				return ret_wait;
+			}
+			if (mutex_lock_interruptible(&(reader->read_mutex))) {
+				return -ERESTARTSYS;
+			}
+		}
+		if (must_wait) {
+			daqdrv_reader_woken(lp, reader);
+		}
+	}
+
+	unsigned int actual_len;
+	u32 cursor;
+	u64 overruns = reader->overruns;
+
+	/*
+	 * The IRQ keeps writing while we copy. It publishes the new tail before
+	 * it overwrites retired blocks, so if the tail is still behind the
+	 * cursor after the copy, nothing we copied was overwritten. Otherwise
+	 * the copy is thrown away and repeated from the new tail.
+	 */
+	while (true) {
+		daqdrv_reader_catch_up(lp, reader);
+		cursor = reader->cursor;
+
+		u32 lag = daqdrv_readable(lp, reader);
+		size_t aligned_len = min_t(size_t, wanted, lag);
+
+		// readers may race here, a lost update only makes the peak a bit low
+		if (lag > READ_ONCE(lp->stats.peak_fill)) {
+			WRITE_ONCE(lp->stats.peak_fill, lag);
+		}
+
+		actual_len = 0;
+		int ret_copy = kfifo_iomod_to_iter_at(&(lp->fifo), to, aligned_len, cursor, &actual_len);
+
+		if (ret_copy) {
+			mutex_unlock(&(reader->read_mutex));
+			printk("EFAULT when copying to userspace!");
+			return ret_copy;
+		}
+
+		smp_rmb();
+		if ((s32)(READ_ONCE(lp->fifo.kfifo_iomod.out) - cursor) <= 0) {
+			break;
+		}
+		iov_iter_revert(to, actual_len);
+	}
+
+	reader->cursor = cursor + actual_len;
+	atomic64_add(actual_len, &(lp->stats.bytes_read));
+
+	// the reader kept up this time
+	if (reader->overflowing && reader->overruns == overruns) {
+		trace_daqdrv_overflow_stop(reader, reader->overflow_bytes);
+		reader->overflowing = false;
+	}
+
+	if (reader->wake_ns != 0) {
+		daqdrv_lat_hist_add(&(lp->lat_wakeup_to_read), ktime_get_ns() - reader->wake_ns);
+		reader->wake_ns = 0;
+	}
+	mutex_unlock(&(reader->read_mutex));
+	return actual_len;
+}
+
+/*
+ * Backs read() as well as splice(). copy_splice_read() hands us pipe pages,
+ * so spliced data is copied once, from the ring straight into the pipe,
+ * and never passes through a userspace buffer.
+ */
+static ssize_t daqdrv_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	size_t requested = iov_iter_count(to);
+	ssize_t ret = daqdrv_do_read_iter(iocb, to);
+
+	trace_daqdrv_read(iocb->ki_filp->private_data, requested, ret);
+	return ret;
+}
+
+unsigned int daqdrv_poll(struct file *filp, struct poll_table_struct *wait)
+{
+	if (filp->f_inode == NULL) {
+		printk("can't find inode\n");
+		return -ENOTRECOVERABLE;
+	}
+
+	if (filp->f_inode->i_cdev == NULL) {
+		printk("can't find chardev\n");
+		return -ENOTRECOVERABLE;
+	}
+
+	struct daqdrv_local *lp = container_of(filp->f_inode->i_cdev, struct daqdrv_local, chardev);
+	if (lp == NULL) {
+		printk("drv data is null\n");
+		return -ENOTRECOVERABLE;
+	}
+
+	poll_wait(filp, &(lp->wait_queue_head), wait);
+
+	unsigned int retval = 0;
+	struct daqdrv_reader *reader = filp->private_data;
+
+	if (daqdrv_readable(lp, reader) >= reader->watermark) {
+		retval = POLLIN | POLLRDNORM;
+		daqdrv_reader_woken(lp, reader);
+	}
+
+	// room for at least what one interrupt takes
+	if (lp->dac_base_addr != NULL && lp->dac_ring_size - daqdrv_dac_fill(lp) >= lp->seg_len) {
+		retval |= POLLOUT | POLLWRNORM;
+	}
+
+	if (trace_daqdrv_poll_enabled()) {
+		trace_daqdrv_poll(reader, daqdrv_readable(lp, reader), retval);
+	}
+	return retval;
+}
+
+/*
+ * Queue samples for the DAC in the output ring. Blocks until there is room
+ * for at least one word, the write may then be short.
+ */
+static ssize_t daqdrv_write(struct file *filp, const char __user *buff, size_t len, loff_t *off)
+{
+	if (filp->f_inode == NULL) {
+		printk("can't find inode\n");
+		return -ENOTRECOVERABLE;
+	}
+
+	if (filp->f_inode->i_cdev == NULL) {
+		printk("can't find chardev\n");
+		return -ENOTRECOVERABLE;
+	}
+
+	struct daqdrv_local *lp = container_of(filp->f_inode->i_cdev, struct daqdrv_local, chardev);
+	if (lp == NULL) {
+		printk("drv data is null\n");
+		return -ENOTRECOVERABLE;
+	}
+
+	if (lp->dac_base_addr == NULL) {
+		return -EOPNOTSUPP;
+	}
+
+	size_t wanted = len - (len % 4);
+	if (wanted == 0) {
+		return -EINVAL;
+	}
+
+	if (mutex_lock_interruptible(&(lp->dac_mutex))) {
+		return -ERESTARTSYS;
+	}
+
+	if (filp->f_flags & O_NONBLOCK) {
+		if (daqdrv_dac_fill(lp) == lp->dac_ring_size) {
+			mutex_unlock(&(lp->dac_mutex));
+			return -EAGAIN;
+		}
+	} else {
+		int ret_wait = wait_event_interruptible(lp->wait_queue_head,
+			daqdrv_dac_fill(lp) < lp->dac_ring_size);
+		if (ret_wait) {
+			mutex_unlock(&(lp->dac_mutex));
+			return ret_wait;
+		}
+	}
+
+	u32 producer = READ_ONCE(lp->dac_ctrl->producer);
+	u32 copy_len = min_t(size_t, wanted, lp->dac_ring_size - daqdrv_dac_fill(lp));
+	u32 pos = producer & (lp->dac_ring_size - 1);
+	u32 first = min_t(u32, copy_len, lp->dac_ring_size - pos);
+
+	if (copy_from_user(lp->dac_ring + pos, buff, first) ||
+	    copy_from_user(lp->dac_ring, buff + first, copy_len - first)) {
+		mutex_unlock(&(lp->dac_mutex));
+		return -EFAULT;
+	}
+
+	smp_store_release(&(lp->dac_ctrl->producer), producer + copy_len);
+	mutex_unlock(&(lp->dac_mutex));
+	return copy_len;
+}
+
+static int daqdrv_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	if (filp->f_inode == NULL) {
+		printk("can't find inode\n");
+		return -ENOTRECOVERABLE;
+	}
+
+	if (filp->f_inode->i_cdev == NULL) {
+		printk("can't find chardev\n");
+		return -ENOTRECOVERABLE;
+	}
+
+	struct daqdrv_local *lp = container_of(filp->f_inode->i_cdev, struct daqdrv_local, chardev);
+	if (lp == NULL) {
+		printk("drv data is null\n");
+		return -ENOTRECOVERABLE;
+	}
+
+	unsigned long length = vma->vm_end - vma->vm_start;
+
+	// the output ring is written by userspace
+	if (vma->vm_pgoff == DAQDRV_MMAP_DAC_CTRL_PGOFF || vma->vm_pgoff == DAQDRV_MMAP_DAC_DATA_PGOFF) {
+		if (lp->dac_base_addr == NULL) {
+			return -EOPNOTSUPP;
+		}
+
+		if (vma->vm_pgoff == DAQDRV_MMAP_DAC_CTRL_PGOFF) {
+			if (length != PAGE_SIZE) {
+				return -EINVAL;
+			}
+
+			return remap_pfn_range(vma, vma->vm_start,
+				virt_to_phys(lp->dac_ctrl) >> PAGE_SHIFT,
+				length, vma->vm_page_prot);
+		}
+
+		if (length != lp->dac_ring_size) {
+			return -EINVAL;
+		}
+
+		return remap_vmalloc_range(vma, lp->dac_ring, 0);
+	}
+
+	// both areas of the capture ring are only written by the driver
+	if (vma->vm_flags & VM_WRITE) {
+		return -EPERM;
+	}
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	if (vma->vm_pgoff == DAQDRV_MMAP_CTRL_PGOFF) {
+		if (length != PAGE_SIZE) {
+			return -EINVAL;
+		}
+
+		return remap_pfn_range(vma, vma->vm_start,
+			virt_to_phys(lp->ring_ctrl) >> PAGE_SHIFT,
+			length, vma->vm_page_prot);
+	}
+
+	if (vma->vm_pgoff == DAQDRV_MMAP_DATA_PGOFF) {
+		if (length != kfifo_iomod_size(&(lp->fifo))) {
+			return -EINVAL;
+		}
+
+		return remap_vmalloc_range(vma, lp->fifo.kfifo_iomod.data, 0);
+	}
+
+	return -EINVAL;
+}
+
+static long daqdrv_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	if (filp->f_inode == NULL) {
+		printk("can't find inode\n");
+		return -ENOTRECOVERABLE;
+	}
+
+	if (filp->f_inode->i_cdev == NULL) {
+		printk("can't find chardev\n");
+		return -ENOTRECOVERABLE;
+	}
+
+	struct daqdrv_local *lp = container_of(filp->f_inode->i_cdev, struct daqdrv_local, chardev);
+	if (lp == NULL) {
+		printk("drv data is null\n");
+		return -ENOTRECOVERABLE;
+	}
+
+	struct daqdrv_reader *reader = filp->private_data;
+	u32 __user *argp = (u32 __user *)arg;
+
+	switch (cmd) {
+	case DAQDRV_IOC_SET_WATERMARK: {
+		u32 watermark;
+		if (get_user(watermark, argp)) {
+			return -EFAULT;
+		}
+
+		// must be whole words and something the ring can actually hold
+		if (watermark < 4 || watermark % 4 != 0 || watermark > kfifo_iomod_size(&(lp->fifo))) {
+			return -EINVAL;
+		}
+
+		reader->watermark = watermark;
+		// a lower watermark might already be satisfied
+		wake_up_interruptible(&(lp->wait_queue_head));
+		return 0;
+	}
+	case DAQDRV_IOC_GET_WATERMARK:
+		return put_user(reader->watermark, argp);
+	case DAQDRV_IOC_GET_OVERRUNS: {
+		struct daqdrv_overruns overruns;
+
+		if (mutex_lock_interruptible(&(reader->read_mutex))) {
+			return -ERESTARTSYS;
+		}
+		overruns.count = reader->overruns;
+		overruns.bytes = reader->lost_bytes;
+		mutex_unlock(&(reader->read_mutex));
+
+		if (copy_to_user((void __user *)arg, &overruns, sizeof(overruns))) {
+			return -EFAULT;
+		}
+		return 0;
+	}
+	case DAQDRV_IOC_GET_VERSION:
+		return put_user(DAQDRV_IOC_VERSION, argp);
+	case DAQDRV_IOC_SET_RATE: {
+		u32 rate_hz;
+		if (get_user(rate_hz, argp)) {
+			return -EFAULT;
+		}
+
+		if (rate_hz < SAMPLE_RATE_MIN_HZ || rate_hz > SAMPLE_RATE_MAX_HZ) {
+			return -EINVAL;
+		}
+
+		// the caller asked for the new rate, it skips what it hasn't read at the old one
+		if (mutex_lock_interruptible(&(reader->read_mutex))) {
+			return -ERESTARTSYS;
+		}
+		int ret_rate = daqdrv_change_sample_rate(lp, rate_hz);
+		u32 rate_pos = smp_load_acquire(&(lp->ring_ctrl->rate_pos));
+		if ((s32)(rate_pos - reader->cursor) > 0) {
+			reader->cursor = rate_pos;
+		}
+		rate_hz = READ_ONCE(lp->sample_rate_hz);
+		mutex_unlock(&(reader->read_mutex));
+
+		if (ret_rate) {
+			return ret_rate;
+		}
+		return put_user(rate_hz, argp);
+	}
+	case DAQDRV_IOC_START:
+		mutex_lock(&(lp->open_mutex));
+		if (lp->allowed_to_read == false) {
+			daqdrv_start(lp, false);
+		}
+		mutex_unlock(&(lp->open_mutex));
+		return 0;
+	case DAQDRV_IOC_STOP:
+		mutex_lock(&(lp->open_mutex));
+		if (lp->allowed_to_read == true) {
+			daqdrv_stop(lp);
+		}
+		mutex_unlock(&(lp->open_mutex));
+		return 0;
+	case DAQDRV_IOC_CLEAR:
+		mutex_lock(&(lp->open_mutex));
+		// the segment count only stays in step if no interrupt races with the clear
+		if (lp->allowed_to_read == true) {
+			daqdrv_pause(lp);
+			daqdrv_resume(lp);
+		} else {
+			daqdrv_clear_fpga(lp);
+		}
+		mutex_unlock(&(lp->open_mutex));
+		return 0;
+	case DAQDRV_IOC_SET_SEGMENTS: {
+		u32 segments;
+		if (get_user(segments, argp)) {
+			return -EFAULT;
+		}
 
-	if (filp->f_inode->i_cdev == NULL) {
-		printk("can't find chardev\n");
-		return -ENOTRECOVERABLE;
-	}
+		if (segments == 0) {
+			return -EINVAL;
+		}
 
-	struct daqdrv_local *lp = container_of(filp->f_inode->i_cdev, struct daqdrv_local, chardev);
-	if (lp == NULL) {
-		printk("drv data is null\n");
-		return -ENOTRECOVERABLE;
+		if (mutex_lock_interruptible(&(reader->read_mutex))) {
+			return -ERESTARTSYS;
+		}
+		mutex_lock(&(lp->open_mutex));
+		// other readers hold positions in the ring, which is emptied on a change
+		bool change = daqdrv_round_segments(lp, segments) != lp->segments;
+		if (change && lp->open_count != 1) {
+			mutex_unlock(&(lp->open_mutex));
+			mutex_unlock(&(reader->read_mutex));
+			return -EBUSY;
+		}
+		segments = daqdrv_set_segments(lp, segments);
+		if (change) {
+			reader->cursor = lp->fifo.kfifo_iomod.in;
+		}
+		mutex_unlock(&(lp->open_mutex));
+		mutex_unlock(&(reader->read_mutex));
+
+		return put_user(segments, argp);
 	}
+	case DAQDRV_IOC_DAC_LOOP: {
+		u32 loop_len;
+		if (get_user(loop_len, argp)) {
+			return -EFAULT;
+		}
+
+		if (lp->dac_base_addr == NULL) {
+			return -EOPNOTSUPP;
+		}
 
-	size_t availible_data = (size_t)kfifo_iomod_len(&(lp->fifo));
-	size_t min_length = min(length, availible_data);
-	size_t aligned_len = min_length - (min_length % 4);
+		if (loop_len % 4 != 0 || loop_len > 4*FPGA_BUF_LEN) {
+			return -EINVAL;
+		}
 
-	if (aligned_len == 0) {
-		return -EAGAIN;
+		mutex_lock(&(lp->open_mutex));
+		int ret_loop = daqdrv_dac_set_loop(lp, loop_len);
+		mutex_unlock(&(lp->open_mutex));
+		return ret_loop;
 	}
+	case DAQDRV_IOC_GET_STATUS: {
+		struct daqdrv_status status;
+		memset(&status, 0, sizeof(status));
+
+		mutex_lock(&(lp->open_mutex));
+		status.version = DAQDRV_IOC_VERSION;
+		if (lp->allowed_to_read) {
+			status.flags |= DAQDRV_STATUS_RUNNING;
+		}
+		if (REG_GET_BIT(ioread32(lp->clk_base_addr + CLK_STAT_REG), CLK_LOCKED_BIT)) {
+			status.flags |= DAQDRV_STATUS_CLK_LOCKED;
+		}
+		status.sample_rate_hz = lp->sample_rate_hz;
+		status.ring_size = kfifo_iomod_size(&(lp->fifo));
+		status.readers = lp->open_count;
+		status.segments = lp->segments;
+		if (lp->dac_base_addr != NULL) {
+			status.flags |= DAQDRV_STATUS_DAC;
+			if (lp->dac_loop_len != 0) {
+				status.flags |= DAQDRV_STATUS_DAC_LOOP;
+			}
+			status.dac_fill = daqdrv_dac_fill(lp);
+			status.dac_loop_len = lp->dac_loop_len;
+		}
+		mutex_unlock(&(lp->open_mutex));
 
-	size_t actual_len = 0;
-	int ret_copy = kfifo_iomod_to_user(&(lp->fifo), buffer, aligned_len, &actual_len);
+		if (mutex_lock_interruptible(&(reader->read_mutex))) {
+			return -ERESTARTSYS;
+		}
+		status.fill = daqdrv_readable(lp, reader);
+		u32 to_rate_pos = smp_load_acquire(&(lp->ring_ctrl->rate_pos)) - reader->cursor;
+		if ((s32)to_rate_pos > 0) {
+			status.rate_change_at = to_rate_pos;
+		}
+		mutex_unlock(&(reader->read_mutex));
 
-	if (ret_copy) {
-		printk("EFAULT when copying to userspace!");
-		return ret_copy;
+		if (copy_to_user((void __user *)arg, &status, sizeof(status))) {
+			return -EFAULT;
+		}
+		return 0;
+	}
+	case DAQDRV_IOC_GET_STATS: {
+		struct daqdrv_statistics stats;
+		memset(&stats, 0, sizeof(stats));
+
+		stats.irqs = atomic64_read(&(lp->stats.irqs));
+		stats.blocks_accepted = atomic64_read(&(lp->stats.blocks_accepted));
+		stats.blocks_dropped = atomic64_read(&(lp->stats.blocks_dropped));
+		stats.overwrites = atomic64_read(&(lp->stats.overwrites));
+		stats.bytes_read = atomic64_read(&(lp->stats.bytes_read));
+		stats.reader_overruns = atomic64_read(&(lp->stats.reader_overruns));
+		stats.peak_fill = READ_ONCE(lp->stats.peak_fill);
+		stats.irq_service_max_ns = READ_ONCE(lp->stats.irq_service_max_ns);
+		stats.dac_underruns = atomic64_read(&(lp->stats.dac_underruns));
+
+		if (copy_to_user((void __user *)arg, &stats, sizeof(stats))) {
+			return -EFAULT;
+		}
+		return 0;
+	}
+	default:
+		return -ENOTTY;
 	}
-
-	return actual_len;
 }
 
-unsigned int daqdrv_poll(struct file *filp, struct poll_table_struct *wait)
+/*
+ * Get a memcpy channel for moving blocks out of the FPGA buffer. Not having
+ * one is fine, the CPU copies the blocks then.
+ */
+static void daqdrv_dma_init(struct device *dev, struct daqdrv_local *lp)
 {
-	if (filp->f_inode == NULL) {
-		printk("can't find inode\n");
-		return -ENOTRECOVERABLE;
+	lp->dma_chan = NULL;
+	lp->dma_busy = false;
+
+	if (use_dma == false) {
+		return;
 	}
 
-	if (filp->f_inode->i_cdev == NULL) {
-		printk("can't find chardev\n");
-		return -ENOTRECOVERABLE;
+	dma_cap_mask_t mask;
+	dma_cap_zero(mask);
+	dma_cap_set(DMA_MEMCPY, mask);
+
+	struct dma_chan *chan = dma_request_chan_by_mask(&mask);
+	if (IS_ERR(chan)) {
+		dev_info(dev, "no DMA memcpy channel (%ld), copying with CPU\n", PTR_ERR(chan));
+		return;
 	}
 
-	struct daqdrv_local *lp = container_of(filp->f_inode->i_cdev, struct daqdrv_local, chardev);
-	if (lp == NULL) {
-		printk("drv data is null\n");
-		return -ENOTRECOVERABLE;
+	lp->dma_src = dma_map_resource(chan->device->dev, lp->buffer_mem_start,
+		4*FPGA_BUF_LEN, DMA_BIDIRECTIONAL, 0);
+	if (dma_mapping_error(chan->device->dev, lp->dma_src)) {
+		dev_info(dev, "mapping FPGA buffer for DMA failed, copying with CPU\n");
+		dma_release_channel(chan);
+		return;
 	}
 
-	poll_wait(filp, &(lp->wait_queue_head), wait);
+	lp->dma_chan = chan;
+	dev_info(dev, "using DMA channel %s\n", dma_chan_name(chan));
+}
 
-	unsigned int retval = 0;
+static void daqdrv_dma_free(struct daqdrv_local *lp)
+{
+	if (lp->dma_chan == NULL) {
+		return;
+	}
 
-	size_t availible_data = (size_t)kfifo_iomod_len(&(lp->fifo));
-	size_t aligned_len = availible_data - (availible_data % 4);
+	dma_unmap_resource(lp->dma_chan->device->dev, lp->dma_src,
+		4*FPGA_BUF_LEN, DMA_BIDIRECTIONAL, 0);
+	dma_release_channel(lp->dma_chan);
+	lp->dma_chan = NULL;
+}
 
-	if (aligned_len != 0) {
-		retval = POLLIN | POLLRDNORM;
+/*
+ * Allocate the output ring if there is a DAC buffer. Without the ring the
+ * output path is disabled, the rest works as before.
+ */
+static void daqdrv_dac_init(struct device *dev, struct daqdrv_local *lp)
+{
+	if (lp->dac_base_addr == NULL) {
+		return;
 	}
 
-	return retval;
+	lp->dac_ring_size = roundup_pow_of_two(clamp_t(unsigned int, dac_ring_size, RING_SIZE_MIN, RING_SIZE_MAX));
+	lp->dac_ring = vmalloc_user(lp->dac_ring_size);
+	lp->dac_ctrl = (struct daqdrv_dac_ctrl *)get_zeroed_page(GFP_KERNEL);
+	if (lp->dac_ring == NULL || lp->dac_ctrl == NULL) {
+		dev_warn(dev, "Allocating DAC output ring failed, output disabled\n");
+		vfree(lp->dac_ring);
+		free_page((unsigned long)lp->dac_ctrl);
+		lp->dac_ring = NULL;
+		lp->dac_ctrl = NULL;
+		// unmapped with the others, unless it belongs to daqdrv-sim
+		if (lp->sim == NULL) {
+			iounmap(lp->dac_base_addr);
+			release_mem_region(lp->dac_mem_start, lp->dac_mem_end - lp->dac_mem_start + 1);
+		}
+		lp->dac_base_addr = NULL;
+		return;
+	}
+
+	lp->dac_ctrl->size = lp->dac_ring_size;
+	lp->dac_ctrl->block_size = lp->seg_len;
+	lp->dac_consumer = 0;
+	lp->dac_last_word = 0;
+	lp->dac_loop_len = 0;
+	lp->dac_streaming = false;
+	iowrite32(0, lp->ctrl_base_addr + DAC_LEN_REG);
+	dev_info(dev, "DAC output ring of %u bytes\n", lp->dac_ring_size);
 }
 
-static ssize_t daqdrv_write(struct file *filp, const char __user *buff, size_t len, loff_t *off)
+static void daqdrv_dac_free(struct daqdrv_local *lp)
 {
-	pr_alert("Sorry, this operation is not supported.\n");
-	return -EINVAL;
+	vfree(lp->dac_ring);
+	free_page((unsigned long)lp->dac_ctrl);
+	lp->dac_ring = NULL;
+	lp->dac_ctrl = NULL;
 }
 
-static int daqdrv_probe(struct platform_device *pdev)
+/*
+ * Claim and map the four register regions of the FPGA design, and the DAC
+ * buffer if there is one.
+ */
+static int daqdrv_map_regions(struct platform_device *pdev, struct daqdrv_local *lp)
 {
-	//struct resource *r_irq; /* Interrupt resources */
 	struct resource *r_mem_buff; /* IO mem resources */
 	struct resource *r_mem_ctrl; /* IO mem resources */
 	struct resource *r_mem_stat; /* IO mem resources */
 	struct resource *r_mem_clk; /* IO mem resources */
 	struct device *dev = &pdev->dev;
-	struct daqdrv_local *lp = NULL;
-	dev_t dvt;
-
 	int rc = 0;
-	dev_info(dev, "Device Tree Probing\n");
+
 	/* Get iospace for the device */
 
 	// Get iospace for buffer
@@ -413,13 +2373,6 @@ static int daqdrv_probe(struct platform_device *pdev)
 		return -ENODEV;
 	}
 
-	// init and allocate daqdrv_local structure
-	lp = (struct daqdrv_local *) kmalloc(sizeof(struct daqdrv_local), GFP_KERNEL);
-	if (!lp) {
-		dev_err(dev, "Cound not allocate daqdrv device\n");
-		return -ENOMEM;
-	}
-	dev_set_drvdata(dev, lp);
 	lp->buffer_mem_start = r_mem_buff->start;
 	lp->buffer_mem_end = r_mem_buff->end;
 	lp->ctrl_mem_start = r_mem_ctrl->start;
@@ -428,8 +2381,6 @@ static int daqdrv_probe(struct platform_device *pdev)
 	lp->stat_mem_end = r_mem_stat->end;
 	lp->clk_mem_start = r_mem_clk->start;
 	lp->clk_mem_end = r_mem_clk->end;
-	lp->allowed_to_read = false;
-	sampleRate = SAMPLE_RATE_2MSPS;
 
 	// request memory region for buffer
 	if (!request_mem_region(lp->buffer_mem_start,
@@ -437,8 +2388,7 @@ static int daqdrv_probe(struct platform_device *pdev)
 				DRIVER_NAME)) {
 		dev_err(dev, "Couldn't lock memory region at %p\n",
 			(void *)lp->buffer_mem_start);
-		rc = -EBUSY;
-		goto error1;
+		return -EBUSY;
 	}
 
 	// request memory region for ctrl
@@ -503,20 +2453,162 @@ static int daqdrv_probe(struct platform_device *pdev)
 		goto error8;
 	}
 
+	// the DAC buffer is optional, without it there is no output path
+	lp->dac_base_addr = NULL;
+	struct resource *r_mem_dac = platform_get_resource(pdev, IORESOURCE_MEM, 4);
+	if (r_mem_dac == NULL) {
+		dev_info(dev, "no DAC buffer, output disabled\n");
+		return 0;
+	}
+
+	if (resource_size(r_mem_dac) < 4*FPGA_BUF_LEN) {
+		dev_warn(dev, "DAC buffer too small, output disabled\n");
+		return 0;
+	}
+
+	lp->dac_mem_start = r_mem_dac->start;
+	lp->dac_mem_end = r_mem_dac->end;
+
+	if (!request_mem_region(lp->dac_mem_start,
+				lp->dac_mem_end - lp->dac_mem_start + 1,
+				DRIVER_NAME)) {
+		dev_warn(dev, "Couldn't lock memory region at %p, output disabled\n",
+			(void *)lp->dac_mem_start);
+		return 0;
+	}
+
+	lp->dac_base_addr = ioremap(lp->dac_mem_start, lp->dac_mem_end - lp->dac_mem_start + 1);
+	if (!lp->dac_base_addr) {
+		dev_warn(dev, "daqdrv: Could not allocate iomem for DAC buffer, output disabled\n");
+		release_mem_region(lp->dac_mem_start, lp->dac_mem_end - lp->dac_mem_start + 1);
+	}
+
+	return 0;
+error8:
+	iounmap(lp->stat_base_addr);
+error7:
+	iounmap(lp->ctrl_base_addr);
+error6:
+	iounmap(lp->buffer_base_addr);
+error5:
+	release_mem_region(lp->clk_mem_start, lp->clk_mem_end - lp->clk_mem_start + 1);
+error4:
+	release_mem_region(lp->stat_mem_start, lp->stat_mem_end - lp->stat_mem_start + 1);
+error3:
+	release_mem_region(lp->ctrl_mem_start, lp->ctrl_mem_end - lp->ctrl_mem_start + 1);
+error2:
+	release_mem_region(lp->buffer_mem_start, lp->buffer_mem_end - lp->buffer_mem_start + 1);
+	return rc;
+}
+
+static void daqdrv_unmap_regions(struct daqdrv_local *lp)
+{
+	// daqdrv-sim owns its regions
+	if (lp->sim != NULL) {
+		return;
+	}
+
+	if (lp->dac_base_addr != NULL) {
+		iounmap(lp->dac_base_addr);
+		release_mem_region(lp->dac_mem_start, lp->dac_mem_end - lp->dac_mem_start + 1);
+	}
+	iounmap(lp->clk_base_addr);
+	iounmap(lp->stat_base_addr);
+	iounmap(lp->ctrl_base_addr);
+	iounmap(lp->buffer_base_addr);
+	release_mem_region(lp->clk_mem_start, lp->clk_mem_end - lp->clk_mem_start + 1);
+	release_mem_region(lp->stat_mem_start, lp->stat_mem_end - lp->stat_mem_start + 1);
+	release_mem_region(lp->ctrl_mem_start, lp->ctrl_mem_end - lp->ctrl_mem_start + 1);
+	release_mem_region(lp->buffer_mem_start, lp->buffer_mem_end - lp->buffer_mem_start + 1);
+}
+
+static int daqdrv_probe(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	struct daqdrv_local *lp = NULL;
+
+	int rc = 0;
+	const struct daqdrv_sim_pdata *sim = dev_get_platdata(dev);
+	if (sim != NULL) {
+		dev_info(dev, "Probing simulated FPGA\n");
+	} else {
+		dev_info(dev, "Device Tree Probing\n");
+	}
+
+	// init and allocate daqdrv_local structure
+	lp = (struct daqdrv_local *) kmalloc(sizeof(struct daqdrv_local), GFP_KERNEL);
+	if (!lp) {
+		dev_err(dev, "Cound not allocate daqdrv device\n");
+		return -ENOMEM;
+	}
+	dev_set_drvdata(dev, lp);
+	lp->allowed_to_read = false;
+	mutex_init(&(lp->open_mutex));
+	lp->open_count = 0;
+	lp->latency_budget_ms = 100;
+	spin_lock_init(&(lp->irq_lock));
+	lp->irq_seq = 0;
+	lp->irq_stat = 0;
+	lp->thread_next_seq = 0;
+	lp->thread_prio_set = false;
+	lp->block_headers = false;
+	lp->next_seq = 0;
+	lp->rate_changed = false;
+	lp->seg_seq0 = 0;
+	lp->segments = 0; /* set at the end of probe */
+	lp->irq_off_max_ns = 0;
+	lp->dma_chan = NULL;
+	atomic64_set(&(lp->stats.irqs), 0);
+	atomic64_set(&(lp->stats.blocks_accepted), 0);
+	atomic64_set(&(lp->stats.blocks_dropped), 0);
+	atomic64_set(&(lp->stats.overwrites), 0);
+	atomic64_set(&(lp->stats.bytes_read), 0);
+	atomic64_set(&(lp->stats.reader_overruns), 0);
+	atomic64_set(&(lp->stats.dac_underruns), 0);
+	lp->stats.peak_fill = 0;
+	lp->stats.irq_service_max_ns = 0;
+	lp->sample_rate_hz = SAMPLE_RATE_MAX_HZ;
+	lp->sim = sim;
+	spin_lock_init(&(lp->dac_lock));
+	mutex_init(&(lp->dac_mutex));
+	lp->dac_base_addr = NULL;
+	lp->dac_ctrl = NULL;
+	lp->dac_ring = NULL;
+
+	// daqdrv-sim hands over plain memory laid out like the FPGA registers
+	if (sim != NULL) {
+		lp->buffer_mem_start = 0;
+		lp->ctrl_mem_start = 0;
+		lp->stat_mem_start = 0;
+		lp->clk_mem_start = 0;
+		lp->buffer_base_addr = sim->buffer;
+		lp->ctrl_base_addr = sim->ctrl;
+		lp->stat_base_addr = sim->stat;
+		lp->clk_base_addr = sim->clk;
+		lp->dac_mem_start = 0;
+		lp->dac_base_addr = sim->dac;
+	} else {
+		rc = daqdrv_map_regions(pdev, lp);
+		if (rc) {
+			goto error1;
+		}
+	}
+
 	init_waitqueue_head(&(lp->wait_queue_head));
 
-	// allocate character device 
-	int ret_alloc_chardev = alloc_chrdev_region(&dvt, 0, num_of_dev, DRIVER_NAME);
-	if (ret_alloc_chardev) {
-		dev_err(dev, "Allocating char device failed with %d\n", ret_alloc_chardev);
-		rc = ret_alloc_chardev;
+	// pick the instance number
+	lp->id = ida_alloc_max(&daqdrv_ida, DAQDRV_MAX_DEVICES - 1, GFP_KERNEL);
+	if (lp->id < 0) {
+		dev_err(dev, "No free daqdrv instance number, %d are in use\n", DAQDRV_MAX_DEVICES);
+		rc = lp->id;
 		goto error9;
 	}
+	lp->devt = MKDEV(MAJOR(daqdrv_devt), MINOR(daqdrv_devt) + lp->id);
+	snprintf(lp->name, sizeof(lp->name), "%s%d", DRIVER_NAME, lp->id);
 
 	// register character device
-	major = MAJOR(dvt);
 	cdev_init(&(lp->chardev), &chardev_fops);
-	int ret_cdev_add = cdev_add(&(lp->chardev), dvt, num_of_dev);
+	int ret_cdev_add = cdev_add(&(lp->chardev), lp->devt, 1);
 	if (ret_cdev_add) {
 		dev_err(dev, "Registering char device failed with %d\n", ret_cdev_add);
 		rc = ret_cdev_add;
@@ -524,33 +2616,120 @@ static int daqdrv_probe(struct platform_device *pdev)
 	}
 
 	// Create device file
-	dev_info(dev, "I was assigned major number %d.\n", major);
-	cls = class_create(DRIVER_NAME);
-	device_create(cls, NULL, dvt, NULL, DRIVER_NAME);
-	dev_info(dev, "Device created on /dev/%s\n", DRIVER_NAME);
+	struct device *chardev_dev = device_create(daqdrv_class, dev, lp->devt, lp, "%s", lp->name);
+	if (IS_ERR(chardev_dev)) {
+		dev_err(dev, "Creating /dev/%s failed with %ld\n", lp->name, PTR_ERR(chardev_dev));
+		rc = PTR_ERR(chardev_dev);
+		cdev_del(&(lp->chardev));
+		goto error10;
+	}
+	dev_info(dev, "Device created on /dev/%s\n", lp->name);
 
 	// allocate fifo
-	int ret_fifo_alloc = kfifo_iomod_alloc(&(lp->fifo), FIFO_BUF_LEN*4, GFP_KERNEL);
+	unsigned int fifo_size = clamp_t(unsigned int, ring_size, RING_SIZE_MIN, RING_SIZE_MAX);
+	int ret_fifo_alloc = kfifo_iomod_alloc(&(lp->fifo), fifo_size, GFP_KERNEL);
 	if (ret_fifo_alloc) {
 		dev_err(dev, "Allocating fifo failed with %d\n", ret_fifo_alloc);
 		rc = ret_fifo_alloc;
 		goto error11;
 	}
 
+	// allocate control page of the ring, it is mapped into userspace
+	lp->ring_ctrl = (struct daqdrv_ring_ctrl *)get_zeroed_page(GFP_KERNEL);
+	if (!lp->ring_ctrl) {
+		dev_err(dev, "Allocating ring control page failed\n");
+		rc = -ENOMEM;
+		goto error12;
+	}
+	lp->ring_ctrl->size = kfifo_iomod_size(&(lp->fifo));
+	lp->ring_ctrl->sample_rate_hz = lp->sample_rate_hz;
+
+	// one interrupt per buffer until a reader asks for smaller blocks
+	if (sim != NULL) {
+		lp->max_segments = sim->max_segments;
+	} else {
+		lp->max_segments = fpga_max_segments;
+	}
+	lp->max_segments = rounddown_pow_of_two(clamp_t(u32, lp->max_segments, 1, SEGMENTS_MAX));
+	daqdrv_set_segments(lp, 1);
+
+	daqdrv_dac_init(dev, lp);
+
 	// create sysfs files
 	kobject_init(&(lp->sampleRate_module_object), &dynamic_kobj_ktype);
-	int ret_kobject_add = kobject_add(&(lp->sampleRate_module_object), kernel_kobj, "%s", DRIVER_NAME);
+	int ret_kobject_add = kobject_add(&(lp->sampleRate_module_object), kernel_kobj, "%s", lp->name);
 	if (ret_kobject_add) {
 		dev_err(dev, "kobject_add error: %d\n", ret_kobject_add);
 		rc = ret_kobject_add;
-		goto error12;
+		goto error13;
 	}
 
 	int ret_sysfs_create_file = sysfs_create_file(&(lp->sampleRate_module_object), &sampleRate_attribute.attr);
 	if (ret_sysfs_create_file) {
 		dev_err(dev, "Sysfs file creation failed with %d.\n", ret_sysfs_create_file);
 		rc = ret_sysfs_create_file;
-		goto error13;
+		goto error14;
+	}
+
+	ret_sysfs_create_file = sysfs_create_file(&(lp->sampleRate_module_object), &sampleRateHz_attribute.attr);
+	if (ret_sysfs_create_file) {
+		dev_err(dev, "Sysfs file creation failed with %d.\n", ret_sysfs_create_file);
+		rc = ret_sysfs_create_file;
+		goto error14;
+	}
+
+	ret_sysfs_create_file = sysfs_create_file(&(lp->sampleRate_module_object), &irqOffMaxNs_attribute.attr);
+	if (ret_sysfs_create_file) {
+		dev_err(dev, "Sysfs file creation failed with %d.\n", ret_sysfs_create_file);
+		rc = ret_sysfs_create_file;
+		goto error14;
+	}
+
+	ret_sysfs_create_file = sysfs_create_file(&(lp->sampleRate_module_object), &blockHeaders_attribute.attr);
+	if (ret_sysfs_create_file) {
+		dev_err(dev, "Sysfs file creation failed with %d.\n", ret_sysfs_create_file);
+		rc = ret_sysfs_create_file;
+		goto error14;
+	}
+
+	ret_sysfs_create_file = sysfs_create_file(&(lp->sampleRate_module_object), &ringSize_attribute.attr);
+	if (ret_sysfs_create_file) {
+		dev_err(dev, "Sysfs file creation failed with %d.\n", ret_sysfs_create_file);
+		rc = ret_sysfs_create_file;
+		goto error14;
+	}
+
+	ret_sysfs_create_file = sysfs_create_file(&(lp->sampleRate_module_object), &latencyBudgetMs_attribute.attr);
+	if (ret_sysfs_create_file) {
+		dev_err(dev, "Sysfs file creation failed with %d.\n", ret_sysfs_create_file);
+		rc = ret_sysfs_create_file;
+		goto error14;
+	}
+
+	ret_sysfs_create_file = sysfs_create_file(&(lp->sampleRate_module_object), &ringSizeSuggested_attribute.attr);
+	if (ret_sysfs_create_file) {
+		dev_err(dev, "Sysfs file creation failed with %d.\n", ret_sysfs_create_file);
+		rc = ret_sysfs_create_file;
+		goto error14;
+	}
+
+	ret_sysfs_create_file = sysfs_create_group(&(lp->sampleRate_module_object), &daqdrv_stats_group);
+	if (ret_sysfs_create_file) {
+		dev_err(dev, "Sysfs group creation failed with %d.\n", ret_sysfs_create_file);
+		rc = ret_sysfs_create_file;
+		goto error14;
+	}
+
+	daqdrv_copy_init(dev, lp);
+	daqdrv_debugfs_init(lp);
+
+	// the simulated FPGA calls daqdrv_irq from an hrtimer instead
+	if (sim != NULL) {
+		if (threaded_irq) {
+			dev_info(dev, "threaded_irq is ignored with the simulated FPGA\n");
+		}
+		dev_info(dev, "daqdrv running on simulated FPGA\n");
+		return 0;
 	}
 
 	// get interrupt
@@ -574,18 +2753,24 @@ static int daqdrv_probe(struct platform_device *pdev)
 	lp->irq = n_irq;
 
 	// register interrupt
-	rc = request_irq(lp->irq, &daqdrv_irq, 0, DRIVER_NAME, lp);
+	if (threaded_irq) {
+		rc = request_threaded_irq(lp->irq, &daqdrv_irq_top, &daqdrv_irq_thread, 0, lp->name, lp);
+	} else {
+		rc = request_irq(lp->irq, &daqdrv_irq, 0, lp->name, lp);
+	}
 	if (rc) {
 		dev_err(dev, "daqdrv: Could not allocate interrupt %d.\n",
 			lp->irq);
-		goto error14;
+		goto error15;
 	}
 	disable_irq(lp->irq);
 
-	dev_info(dev,"daqdrv buffer at 0x%08x mapped to 0x%08x, irq=%d\n",
+	daqdrv_dma_init(dev, lp);
+
+	dev_info(dev,"daqdrv buffer at 0x%08x mapped to 0x%08x, irq=%d%s\n",
 		(unsigned int __force)lp->buffer_mem_start,
 		(unsigned int __force)lp->buffer_base_addr,
-		lp->irq);
+		lp->irq, threaded_irq ? " (threaded)" : "");
 	dev_info(dev,"daqdrv ctrl at 0x%08x mapped to 0x%08x",
 		(unsigned int __force)lp->ctrl_mem_start,
 		(unsigned int __force)lp->ctrl_base_addr);
@@ -596,34 +2781,23 @@ static int daqdrv_probe(struct platform_device *pdev)
 		(unsigned int __force)lp->clk_mem_start,
 		(unsigned int __force)lp->clk_base_addr);
 	return 0;
-error14:
+error15:
 	free_irq(lp->irq, lp);
-error13:
+	debugfs_remove_recursive(lp->debugfs_dir);
+error14:
 	kobject_put(&(lp->sampleRate_module_object));
+error13:
+	daqdrv_dac_free(lp);
+	free_page((unsigned long)lp->ring_ctrl);
 error12:
 	kfifo_iomod_free(&(lp->fifo));
 error11:
-	device_destroy(cls, dvt);
-	class_destroy(cls);
+	device_destroy(daqdrv_class, lp->devt);
 	cdev_del(&(lp->chardev));
 error10:
-	unregister_chrdev_region(dvt, num_of_dev);
+	ida_free(&daqdrv_ida, lp->id);
 error9:
-	iounmap(lp->clk_base_addr);
-error8:
-	iounmap(lp->stat_base_addr);
-error7:
-	iounmap(lp->ctrl_base_addr);
-error6:
-	iounmap(lp->buffer_base_addr);
-error5:
-	release_mem_region(lp->clk_mem_start, lp->clk_mem_end - lp->clk_mem_start + 1);
-error4:
-	release_mem_region(lp->stat_mem_start, lp->stat_mem_end - lp->stat_mem_start + 1);
-error3:
-	release_mem_region(lp->ctrl_mem_start, lp->ctrl_mem_end - lp->ctrl_mem_start + 1);
-error2:
-	release_mem_region(lp->buffer_mem_start, lp->buffer_mem_end - lp->buffer_mem_start + 1);
+	daqdrv_unmap_regions(lp);
 error1:
 	kfree(lp);
 	dev_set_drvdata(dev, NULL);
@@ -632,26 +2806,25 @@ error1:
 
 static int daqdrv_remove(struct platform_device *pdev)
 {
-	dev_t dvt = MKDEV(major, 0);
 	struct device *dev = &pdev->dev;
 	struct daqdrv_local *lp = dev_get_drvdata(dev);
-	free_irq(lp->irq, lp);
+	debugfs_remove_recursive(lp->debugfs_dir);
+	if (lp->sim != NULL) {
+		lp->sim->stop(lp->sim);
+	} else {
+		free_irq(lp->irq, lp);
+	}
+	daqdrv_dma_free(lp);
 	kobject_put(&(lp->sampleRate_module_object));
+	daqdrv_dac_free(lp);
+	free_page((unsigned long)lp->ring_ctrl);
 	kfifo_iomod_free(&(lp->fifo));
 
-	device_destroy(cls, dvt);
-	class_destroy(cls);
+	device_destroy(daqdrv_class, lp->devt);
 	cdev_del(&(lp->chardev));
-	unregister_chrdev_region(dvt, num_of_dev);
+	ida_free(&daqdrv_ida, lp->id);
 
-	iounmap(lp->clk_base_addr);
-	iounmap(lp->stat_base_addr);
-	iounmap(lp->ctrl_base_addr);
-	iounmap(lp->buffer_base_addr);
-	release_mem_region(lp->clk_mem_start, lp->clk_mem_end - lp->clk_mem_start + 1);
-	release_mem_region(lp->stat_mem_start, lp->stat_mem_end - lp->stat_mem_start + 1);
-	release_mem_region(lp->ctrl_mem_start, lp->ctrl_mem_end - lp->ctrl_mem_start + 1);
-	release_mem_region(lp->buffer_mem_start, lp->buffer_mem_end - lp->buffer_mem_start + 1);
+	daqdrv_unmap_regions(lp);
 	kfree(lp);
 	dev_set_drvdata(dev, NULL);
 	return 0;
@@ -667,6 +2840,13 @@ MODULE_DEVICE_TABLE(of, daqdrv_of_match);
 # define daqdrv_of_match
 #endif
 
+/* devices without a DT node, matched by name */
+static const struct platform_device_id daqdrv_id_table[] = {
+	{ .name = DAQDRV_SIM_NAME, },
+	{ /* end of list */ },
+};
+MODULE_DEVICE_TABLE(platform, daqdrv_id_table);
+
 
 static struct platform_driver daqdrv_driver = {
 	.driver = {
@@ -674,6 +2854,7 @@ static struct platform_driver daqdrv_driver = {
 		.owner = THIS_MODULE,
 		.of_match_table	= daqdrv_of_match,
 	},
+	.id_table	= daqdrv_id_table,
 	.probe		= daqdrv_probe,
 	.remove		= daqdrv_remove,
 };
@@ -681,13 +2862,45 @@ static struct platform_driver daqdrv_driver = {
 static int __init daqdrv_init(void)
 {
 	printk("<1>DAQ driver loaded.\n");
-	return platform_driver_register(&daqdrv_driver);
+
+	if (irq_thread_prio < 1 || irq_thread_prio > MAX_RT_PRIO - 1) {
+		printk("irq_thread_prio %d out of range, using %d\n", irq_thread_prio, MAX_RT_PRIO / 2);
+		irq_thread_prio = MAX_RT_PRIO / 2;
+	}
+
+	// shared by all instances, each takes one minor
+	int rc = alloc_chrdev_region(&daqdrv_devt, 0, DAQDRV_MAX_DEVICES, DRIVER_NAME);
+	if (rc) {
+		printk("Allocating char devices failed with %d\n", rc);
+		return rc;
+	}
+	printk("I was assigned major number %d.\n", MAJOR(daqdrv_devt));
+
+	daqdrv_class = class_create(DRIVER_NAME);
+	if (IS_ERR(daqdrv_class)) {
+		rc = PTR_ERR(daqdrv_class);
+		goto error1;
+	}
+
+	rc = platform_driver_register(&daqdrv_driver);
+	if (rc) {
+		goto error2;
+	}
+	return 0;
+error2:
+	class_destroy(daqdrv_class);
+error1:
+	unregister_chrdev_region(daqdrv_devt, DAQDRV_MAX_DEVICES);
+	return rc;
 }
 
 
 static void __exit daqdrv_exit(void)
 {
 	platform_driver_unregister(&daqdrv_driver);
+	class_destroy(daqdrv_class);
+	unregister_chrdev_region(daqdrv_devt, DAQDRV_MAX_DEVICES);
+	ida_destroy(&daqdrv_ida);
 	printk(KERN_ALERT "DAQ driver exited.\n");
 }
 
@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright 2025, University of Ljubljana
+ *
+ * This file is part of Cora-Z7-DAQ-OS.
+ * Cora-Z7-DAQ-OS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or any later version.
+ * Cora-Z7-DAQ-OS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Cora-Z7-DAQ-OS.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Built with NEON enabled, see the Makefile. Nothing else goes in here, the
+ * compiler may use NEON anywhere in this file and that is only safe between
+ * kernel_neon_begin() and kernel_neon_end().
+ */
+
+#include <linux/types.h>
+#include <linux/io.h>
+#include <asm/neon.h>
+#include <asm/simd.h>
+
+#include "daqdrv-neon.h"
+
+#define NEON_BURST 64
+
+void daqdrv_neon_copy_fromio(void *dst, const void __iomem *src, size_t len)
+{
+	size_t bursts = len & ~(size_t)(NEON_BURST - 1);
+
+	if (bursts == 0 || !may_use_simd()) {
+		memcpy_fromio(dst, src, len);
+		return;
+	}
+
+	const void __iomem *s = src;
+	void *d = dst;
+	size_t n = bursts;
+
+	kernel_neon_begin();
+	// one vldm of eight d registers becomes a single 64 byte AXI burst
+	asm volatile(
+		"1:	vldmia	%[s]!, {d0-d7}\n"
+		"	vstmia	%[d]!, {d0-d7}\n"
+		"	subs	%[n], %[n], #64\n"
+		"	bne	1b\n"
+		: [s] "+r" (s), [d] "+r" (d), [n] "+r" (n)
+		:
+		: "d0", "d1", "d2", "d3", "d4", "d5", "d6", "d7", "cc", "memory");
+	kernel_neon_end();
+
+	if (len != bursts) {
+		memcpy_fromio(dst + bursts, src + bursts, len - bursts);
+	}
+}
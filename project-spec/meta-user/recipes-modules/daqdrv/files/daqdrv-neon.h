@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * Copyright 2025, University of Ljubljana
+ *
+ * This file is part of Cora-Z7-DAQ-OS.
+ * Cora-Z7-DAQ-OS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or any later version.
+ * Cora-Z7-DAQ-OS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Cora-Z7-DAQ-OS.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DAQDRV_NEON_H
+#define _DAQDRV_NEON_H
+
+#include <linux/types.h>
+
+/*
+ * Copy from the FPGA buffer in 64 byte NEON bursts. Kernel mode NEON is not
+ * allowed in hard IRQ context, there it falls back to memcpy_fromio().
+ * Only built for 32-bit ARM with CONFIG_KERNEL_MODE_NEON.
+ */
+#if defined(CONFIG_ARM) && defined(CONFIG_KERNEL_MODE_NEON)
+#define DAQDRV_HAVE_NEON 1
+void daqdrv_neon_copy_fromio(void *dst, const void __iomem *src, size_t len);
+#else
+#define DAQDRV_HAVE_NEON 0
+#endif
+
+#endif
@@ -0,0 +1,244 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright 2025, University of Ljubljana
+ *
+ * This file is part of Cora-Z7-DAQ-OS.
+ * Cora-Z7-DAQ-OS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or any later version.
+ * Cora-Z7-DAQ-OS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Cora-Z7-DAQ-OS.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/io.h>
+#include <linux/interrupt.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/platform_device.h>
+
+#include "daqdrv-sim.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR
+    ("Stas Bucik");
+MODULE_DESCRIPTION
+    ("daqdrv-sim - software stand-in for the daqdrv FPGA design, for testing without hardware.");
+
+/* the bits and registers of the FPGA design that the simulation looks at, see daqdrv-core.c */
+#define ADC_RUN_BIT    0
+#define DAC_RUN_BIT    1
+#define SEGMENTS_SHIFT 4
+#define SEGMENTS_MASK  0x3
+#define SEGMENTS_MAX   8
+#define OVERWRITE_BIT  0
+#define CLK_LOCKED_BIT 0
+
+#define DAC_LEN_REG         0x4 /* in ctrl */
+#define CLK_STAT_REG        0x4
+#define CLK_CLK_CONF_REG_0  0x200
+#define CLK_CLK_CONF_REG_2  0x208
+#define CLK_CLK_CONF_REG_23 0x25C
+
+#define MMCM_FIN_HZ     100000000ULL
+#define CLK_PER_SAMPLE  32
+#define DEFAULT_RATE_HZ 2000000 /* what the vivado generated clock settings give */
+
+/* each 32-bit word of the buffer holds two 12-bit samples */
+#define SAMPLES_PER_BLOCK (DAQDRV_SIM_BUFFER_LEN / 2)
+#define WORDS_PER_BLOCK   (DAQDRV_SIM_BUFFER_LEN / 4)
+
+static bool loopback;
+module_param(loopback, bool, 0444);
+MODULE_PARM_DESC(loopback, "The ADC samples the DAC output instead of a sawtooth");
+
+struct daqdrv_sim {
+	struct platform_device *pdev;
+	struct daqdrv_sim_pdata pdata;
+	struct hrtimer timer;
+	irq_handler_t handler;
+	void *data;
+	u32 sample; /* next value of the sawtooth */
+	u32 seg; /* segment of the buffer the next tick fills */
+	u32 word; /* words the DAC played since start() */
+	u32 buffer[DAQDRV_SIM_BUFFER_LEN / 4];
+	u32 dac[DAQDRV_SIM_BUFFER_LEN / 4];
+	u32 ctrl[DAQDRV_SIM_REGS_LEN / 4];
+	u32 stat[DAQDRV_SIM_REGS_LEN / 4];
+	u32 clk[DAQDRV_SIM_REGS_LEN / 4];
+};
+
+static struct daqdrv_sim *daqdrv_sim;
+
+/*
+ * Sample rate the clocking wizard registers ask for, decoded the same way
+ * daqdrv_set_sample_rate() encodes it.
+ */
+static u32 daqdrv_sim_rate_hz(struct daqdrv_sim *sim)
+{
+	u32 reg23 = READ_ONCE(sim->clk[CLK_CLK_CONF_REG_23 / 4]);
+	if ((reg23 & (1u << 1)) == 0) {
+		return DEFAULT_RATE_HZ;
+	}
+
+	u32 reg0 = READ_ONCE(sim->clk[CLK_CLK_CONF_REG_0 / 4]);
+	u32 reg2 = READ_ONCE(sim->clk[CLK_CLK_CONF_REG_2 / 4]);
+	u32 d = reg0 & 0xff;
+	u32 m8 = ((reg0 >> 8) & 0xff) * 8 + ((reg0 >> 16) & 0x3ff) / 125;
+	u32 o8 = (reg2 & 0xff) * 8 + ((reg2 >> 8) & 0x3ff) / 125;
+	if (d == 0 || m8 == 0 || o8 == 0) {
+		return DEFAULT_RATE_HZ;
+	}
+
+	return (u32)div_u64(MMCM_FIN_HZ * m8, d * o8 * CLK_PER_SAMPLE);
+}
+
+static u32 daqdrv_sim_segments(struct daqdrv_sim *sim)
+{
+	u32 segments = 1u << ((READ_ONCE(sim->ctrl[0]) >> SEGMENTS_SHIFT) & SEGMENTS_MASK);
+	return min_t(u32, segments, sim->pdata.max_segments);
+}
+
+/* one tick per segment */
+static ktime_t daqdrv_sim_period(struct daqdrv_sim *sim)
+{
+	u32 rate_hz = daqdrv_sim_rate_hz(sim);
+	u32 samples = SAMPLES_PER_BLOCK / daqdrv_sim_segments(sim);
+	return ns_to_ktime(div_u64((u64)samples * NSEC_PER_SEC, max_t(u32, rate_hz, 1)));
+}
+
+/*
+ * The ADC sees a sawtooth, so any lost or repeated sample shows in the
+ * stream. With loopback it sees what the DAC played meanwhile instead.
+ */
+static void daqdrv_sim_fill(struct daqdrv_sim *sim, u32 segments)
+{
+	u32 words = WORDS_PER_BLOCK / segments;
+	u32 *seg = sim->buffer + (sim->seg % segments) * words;
+
+	if (loopback) {
+		u32 dac_words = READ_ONCE(sim->ctrl[DAC_LEN_REG / 4]);
+		if (dac_words == 0 || dac_words > WORDS_PER_BLOCK) {
+			dac_words = WORDS_PER_BLOCK;
+		}
+		bool dac_run = READ_ONCE(sim->ctrl[0]) & (1u << DAC_RUN_BIT);
+
+		for (u32 i = 0; i < words; i++) {
+			seg[i] = dac_run ? (READ_ONCE(sim->dac[(sim->word + i) % dac_words]) & 0xffffff) : 0;
+		}
+	} else {
+		for (u32 i = 0; i < words; i++) {
+			u32 first = sim->sample++ & 0xfff;
+			u32 second = sim->sample++ & 0xfff;
+			seg[i] = (first << 12) | second;
+		}
+	}
+	sim->seg = (sim->seg + 1) % segments;
+	sim->word += words;
+}
+
+static enum hrtimer_restart daqdrv_sim_tick(struct hrtimer *timer)
+{
+	struct daqdrv_sim *sim = container_of(timer, struct daqdrv_sim, timer);
+
+	// the period follows the clock registers, like the real ADC would
+	u64 periods = hrtimer_forward_now(timer, daqdrv_sim_period(sim));
+
+	if ((READ_ONCE(sim->ctrl[0]) & (1u << ADC_RUN_BIT)) == 0) {
+		return HRTIMER_RESTART;
+	}
+
+	u32 segments = daqdrv_sim_segments(sim);
+
+	// a late timer is what a late interrupt is on the board, the FPGA kept
+	// sampling and overwrote the block before it was read. The segment
+	// stays the one after the last interrupt, daqdrv counts segments by
+	// interrupts and would read a stale one otherwise.
+	if (periods > 1) {
+		sim->sample += (u32)((periods - 1) * (SAMPLES_PER_BLOCK / segments));
+		sim->word += (u32)((periods - 1) * (WORDS_PER_BLOCK / segments));
+		WRITE_ONCE(sim->stat[0], 1u << OVERWRITE_BIT);
+	} else {
+		WRITE_ONCE(sim->stat[0], 0);
+	}
+
+	daqdrv_sim_fill(sim, segments);
+	sim->handler(0, sim->data);
+	return HRTIMER_RESTART;
+}
+
+static void daqdrv_sim_start(const struct daqdrv_sim_pdata *pdata, irq_handler_t handler, void *data)
+{
+	struct daqdrv_sim *sim = pdata->priv;
+
+	sim->handler = handler;
+	sim->data = data;
+	sim->sample = 0;
+	sim->seg = 0;
+	sim->word = 0;
+	WRITE_ONCE(sim->stat[0], 0);
+	hrtimer_start(&(sim->timer), daqdrv_sim_period(sim), HRTIMER_MODE_REL_HARD);
+}
+
+static void daqdrv_sim_stop(const struct daqdrv_sim_pdata *pdata)
+{
+	struct daqdrv_sim *sim = pdata->priv;
+
+	hrtimer_cancel(&(sim->timer));
+}
+
+static int __init daqdrv_sim_init(void)
+{
+	struct daqdrv_sim *sim = kzalloc(sizeof(struct daqdrv_sim), GFP_KERNEL);
+	if (sim == NULL) {
+		return -ENOMEM;
+	}
+
+	// the MMCM locks instantly and its monitor never reports errors
+	sim->clk[CLK_STAT_REG / 4] = 1u << CLK_LOCKED_BIT;
+
+	hrtimer_init(&(sim->timer), CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+	sim->timer.function = daqdrv_sim_tick;
+
+	sim->pdata.buffer = (void __iomem __force *)sim->buffer;
+	sim->pdata.ctrl = (void __iomem __force *)sim->ctrl;
+	sim->pdata.stat = (void __iomem __force *)sim->stat;
+	sim->pdata.clk = (void __iomem __force *)sim->clk;
+	sim->pdata.dac = (void __iomem __force *)sim->dac;
+	sim->pdata.max_segments = SEGMENTS_MAX;
+	sim->pdata.priv = sim;
+	sim->pdata.start = daqdrv_sim_start;
+	sim->pdata.stop = daqdrv_sim_stop;
+
+	sim->pdev = platform_device_register_data(NULL, DAQDRV_SIM_NAME, PLATFORM_DEVID_NONE,
+		&(sim->pdata), sizeof(sim->pdata));
+	if (IS_ERR(sim->pdev)) {
+		int rc = PTR_ERR(sim->pdev);
+		kfree(sim);
+		return rc;
+	}
+
+	daqdrv_sim = sim;
+	printk("DAQ simulator loaded.\n");
+	return 0;
+}
+
+static void __exit daqdrv_sim_exit(void)
+{
+	// daqdrv is unbound from the device first, it stops the timer then
+	platform_device_unregister(daqdrv_sim->pdev);
+	hrtimer_cancel(&(daqdrv_sim->timer));
+	kfree(daqdrv_sim);
+	printk("DAQ simulator exited.\n");
+}
+
+module_init(daqdrv_sim_init);
+module_exit(daqdrv_sim_exit);
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * Copyright 2025, University of Ljubljana
+ *
+ * This file is part of Cora-Z7-DAQ-OS.
+ * Cora-Z7-DAQ-OS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or any later version.
+ * Cora-Z7-DAQ-OS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Cora-Z7-DAQ-OS.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DAQDRV_SIM_H
+#define _DAQDRV_SIM_H
+
+#include <linux/types.h>
+#include <linux/interrupt.h>
+
+/*
+ * Interface between daqdrv and daqdrv-sim, the software stand-in for the FPGA.
+ *
+ * daqdrv-sim registers a platform device named DAQDRV_SIM_NAME with this as
+ * its platform data. The four register regions are plain kernel memory laid
+ * out like the real ones, daqdrv uses them instead of ioremapping resources.
+ * start() makes an hrtimer call handler(0, data) in hard IRQ context once per
+ * block, at the period the emulated clocking wizard registers imply, for as
+ * long as ADC_RUN is set in ctrl. stop() waits for a running call to finish.
+ * The segment field of ctrl is honoured up to max_segments, start() begins
+ * with segment 0. dac is the DAC buffer, the same size as buffer.
+ */
+#define DAQDRV_SIM_NAME "daqdrv-sim"
+
+#define DAQDRV_SIM_BUFFER_LEN (4 * 4096) /* 4*FPGA_BUF_LEN of daqdrv */
+#define DAQDRV_SIM_REGS_LEN   0x800      /* size of each register region */
+
+struct daqdrv_sim_pdata {
+	void __iomem *buffer;
+	void __iomem *ctrl;
+	void __iomem *stat;
+	void __iomem *clk;
+	void __iomem *dac;
+	u32 max_segments;
+	void *priv;
+	void (*start)(const struct daqdrv_sim_pdata *pdata, irq_handler_t handler, void *data);
+	void (*stop)(const struct daqdrv_sim_pdata *pdata);
+};
+
+#endif
@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * Copyright 2025, University of Ljubljana
+ *
+ * This file is part of Cora-Z7-DAQ-OS.
+ * Cora-Z7-DAQ-OS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or any later version.
+ * Cora-Z7-DAQ-OS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Cora-Z7-DAQ-OS.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tracepoints of daqdrv, in events/daqdrv of tracefs. Readers are told apart
+ * by the address of their struct daqdrv_reader, fill is the number of bytes
+ * between the tail and the producer of the capture ring.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM daqdrv
+
+#if !defined(_DAQDRV_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _DAQDRV_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* thread is set in the IRQ thread of threaded_irq mode, the top half traces as a plain IRQ */
+TRACE_EVENT(daqdrv_irq_entry,
+	TP_PROTO(u64 seq, bool thread),
+	TP_ARGS(seq, thread),
+	TP_STRUCT__entry(
+		__field(u64, seq)
+		__field(bool, thread)
+	),
+	TP_fast_assign(
+		__entry->seq = seq;
+		__entry->thread = thread;
+	),
+	TP_printk("seq=%llu thread=%d", __entry->seq, __entry->thread)
+);
+
+/* bytes were put in the ring or handed to DMA, 0 if the block was dropped or only latched */
+TRACE_EVENT(daqdrv_irq_exit,
+	TP_PROTO(u64 seq, bool thread, u32 bytes, u32 fill),
+	TP_ARGS(seq, thread, bytes, fill),
+	TP_STRUCT__entry(
+		__field(u64, seq)
+		__field(bool, thread)
+		__field(u32, bytes)
+		__field(u32, fill)
+	),
+	TP_fast_assign(
+		__entry->seq = seq;
+		__entry->thread = thread;
+		__entry->bytes = bytes;
+		__entry->fill = fill;
+	),
+	TP_printk("seq=%llu thread=%d bytes=%u fill=%u",
+		__entry->seq, __entry->thread, __entry->bytes, __entry->fill)
+);
+
+/* the FPGA reported OVERWRITE_BIT for the block */
+TRACE_EVENT(daqdrv_overwrite,
+	TP_PROTO(u64 seq, u32 stat),
+	TP_ARGS(seq, stat),
+	TP_STRUCT__entry(
+		__field(u64, seq)
+		__field(u32, stat)
+	),
+	TP_fast_assign(
+		__entry->seq = seq;
+		__entry->stat = stat;
+	),
+	TP_printk("seq=%llu stat=0x%08x", __entry->seq, __entry->stat)
+);
+
+/*
+ * A reader fell behind by more than the ring and starts losing data, and
+ * the first read after that which lost nothing more. bytes is what the first
+ * skip lost for start, and what was lost in total for stop.
+ */
+DECLARE_EVENT_CLASS(daqdrv_overflow,
+	TP_PROTO(const void *reader, u64 bytes),
+	TP_ARGS(reader, bytes),
+	TP_STRUCT__entry(
+		__field(const void *, reader)
+		__field(u64, bytes)
+	),
+	TP_fast_assign(
+		__entry->reader = reader;
+		__entry->bytes = bytes;
+	),
+	TP_printk("reader=%p bytes=%llu", __entry->reader, __entry->bytes)
+);
+
+DEFINE_EVENT(daqdrv_overflow, daqdrv_overflow_start,
+	TP_PROTO(const void *reader, u64 bytes),
+	TP_ARGS(reader, bytes)
+);
+
+DEFINE_EVENT(daqdrv_overflow, daqdrv_overflow_stop,
+	TP_PROTO(const void *reader, u64 bytes),
+	TP_ARGS(reader, bytes)
+);
+
+/* ret is what read() or splice() returned */
+TRACE_EVENT(daqdrv_read,
+	TP_PROTO(const void *reader, size_t requested, ssize_t ret),
+	TP_ARGS(reader, requested, ret),
+	TP_STRUCT__entry(
+		__field(const void *, reader)
+		__field(size_t, requested)
+		__field(ssize_t, ret)
+	),
+	TP_fast_assign(
+		__entry->reader = reader;
+		__entry->requested = requested;
+		__entry->ret = ret;
+	),
+	TP_printk("reader=%p requested=%zu ret=%zd", __entry->reader, __entry->requested, __entry->ret)
+);
+
+TRACE_EVENT(daqdrv_poll,
+	TP_PROTO(const void *reader, u32 readable, unsigned int mask),
+	TP_ARGS(reader, readable, mask),
+	TP_STRUCT__entry(
+		__field(const void *, reader)
+		__field(u32, readable)
+		__field(unsigned int, mask)
+	),
+	TP_fast_assign(
+		__entry->reader = reader;
+		__entry->readable = readable;
+		__entry->mask = mask;
+	),
+	TP_printk("reader=%p readable=%u mask=0x%x", __entry->reader, __entry->readable, __entry->mask)
+);
+
+#endif
+
+/* the header isn't in include/trace/events, Makefile adds this directory to the include path */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE daqdrv-trace
+#include <trace/define_trace.h>
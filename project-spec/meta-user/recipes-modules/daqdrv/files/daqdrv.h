@@ -0,0 +1,240 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later WITH Linux-syscall-note */
+/*
+ * Copyright 2025, University of Ljubljana
+ *
+ * This file is part of Cora-Z7-DAQ-OS.
+ * Cora-Z7-DAQ-OS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or any later version.
+ * Cora-Z7-DAQ-OS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Cora-Z7-DAQ-OS.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DAQDRV_H
+#define _DAQDRV_H
+
+/*
+ * Userspace interface of daqdrv, shared between the driver and the servers.
+ */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * mmap() offsets of /dev/daqdrvN, in pages.
+ *
+ * DAQDRV_MMAP_CTRL_PGOFF maps one page holding struct daqdrv_ring_ctrl.
+ * DAQDRV_MMAP_DATA_PGOFF maps the capture ring, its length must equal
+ * daqdrv_ring_ctrl.size. Both can only be mapped read-only.
+ *
+ * DAQDRV_MMAP_DAC_CTRL_PGOFF maps one page holding struct daqdrv_dac_ctrl,
+ * DAQDRV_MMAP_DAC_DATA_PGOFF the output ring of daqdrv_dac_ctrl.size bytes.
+ * Both can be mapped writable, they only exist if the FPGA design has a DAC
+ * buffer (DAQDRV_STATUS_DAC).
+ */
+#define DAQDRV_MMAP_CTRL_PGOFF 0
+#define DAQDRV_MMAP_DATA_PGOFF 1
+#define DAQDRV_MMAP_DAC_CTRL_PGOFF 2
+#define DAQDRV_MMAP_DAC_DATA_PGOFF 3
+
+/*
+ * Control page of the capture ring.
+ *
+ * producer and tail are free running byte counters, the position in the
+ * data area is (index & (size - 1)). Bytes between tail and producer are
+ * valid. rate_pos is a position of the same kind, data before it was sampled
+ * at the previous rate. The ring is shared by all readers and the driver never waits for
+ * them: when it is full, the oldest blocks are retired by advancing tail
+ * before they are overwritten. A reader keeps its own position, and after
+ * it is done with data at position pos it must check that tail hasn't moved
+ * past pos, otherwise the data may have been overwritten while it was used.
+ */
+struct daqdrv_ring_ctrl {
+	__u32 size;		/* size of the data area in bytes, power of 2 */
+	__u32 block_size;	/* bytes of samples added to the ring per interrupt */
+	__u32 flags;		/* DAQDRV_RING_FLAG_* */
+	__u32 sample_rate_hz;	/* current sample rate */
+	__u32 rate_pos;		/* where data at sample_rate_hz starts */
+	__u32 __reserved0[3];
+	__u32 producer;		/* end of valid data */
+	__u32 tail;		/* start of valid data */
+	__u32 __reserved1[14];
+};
+
+/* every block in the ring starts with struct daqdrv_block_hdr */
+#define DAQDRV_RING_FLAG_BLOCK_HEADERS (1u << 0)
+
+/*
+ * Header in front of every block when /sys/kernel/daqdrvN/blockHeaders is 1.
+ *
+ * The stream then consists of a header followed by length bytes of samples,
+ * repeated. sequence counts the FPGA interrupts since the first reader opened
+ * the device, including the blocks that were dropped, so a gap in sequence
+ * is exactly the number of blocks this reader lost. dropped only counts the
+ * blocks the driver itself couldn't take. timestamp_ns is CLOCK_MONOTONIC at
+ * the interrupt that announced the block. sample_rate_hz is the rate the
+ * block was sampled at, the first block after a rate change is flagged with
+ * DAQDRV_BLOCK_FLAG_RATE_CHANGE.
+ */
+#define DAQDRV_BLOCK_MAGIC 0x4b4c4244 /* "DBLK" */
+
+#define DAQDRV_BLOCK_FLAG_OVERWRITE (1u << 0) /* FPGA may have overwritten the block before it was copied */
+#define DAQDRV_BLOCK_FLAG_DROPPED   (1u << 1) /* blocks right before this one were dropped */
+#define DAQDRV_BLOCK_FLAG_RATE_CHANGE (1u << 2) /* first block at a new sample rate */
+
+struct daqdrv_block_hdr {
+	__u32 magic;
+	__u32 length;		/* bytes of samples following the header */
+	__u64 sequence;
+	__u64 timestamp_ns;
+	__u32 flags;		/* DAQDRV_BLOCK_FLAG_* */
+	__u32 dropped;		/* number of blocks dropped right before this one */
+	__u32 sample_rate_hz;
+	__u32 __reserved;
+};
+
+/*
+ * Control page of the output ring, which feeds the DAC.
+ *
+ * The DAC plays the words of its FPGA buffer at the sample rate, in step
+ * with the ADC. Each interrupt the driver refills the segment that was just
+ * played with block_size bytes from the output ring, so samples written now
+ * come out within one FPGA buffer. The words go to the FPGA as they are, two
+ * 12-bit samples each like the capture blocks.
+ *
+ * producer and consumer are free running byte counters like the ones of
+ * daqdrv_ring_ctrl. The writer puts whole words at producer and then
+ * advances it, either with write() or by writing the mapped ring and storing
+ * producer itself, one or the other. The driver advances consumer. When the
+ * ring runs dry the DAC holds the last word and underruns counts the segment.
+ * In loop mode (DAQDRV_DAC_FLAG_LOOP, see DAQDRV_IOC_DAC_LOOP) the FPGA
+ * repeats a waveform by itself and the ring isn't read.
+ */
+struct daqdrv_dac_ctrl {
+	__u32 size;		/* size of the data area in bytes, power of 2 */
+	__u32 block_size;	/* bytes taken from the ring per interrupt */
+	__u32 flags;		/* DAQDRV_DAC_FLAG_* */
+	__u32 loop_len;		/* bytes of the looped waveform */
+	__u32 producer;		/* end of the data written, advanced by the writer */
+	__u32 consumer;		/* start of the data not played yet, advanced by the driver */
+	__u64 underruns;	/* segments the ring couldn't fill */
+	__u32 __reserved[8];
+};
+
+#define DAQDRV_DAC_FLAG_LOOP (1u << 0)
+
+/*
+ * ioctl() commands of /dev/daqdrvN.
+ *
+ * DAQDRV_IOC_SET_WATERMARK sets how many bytes must be buffered before a
+ * blocking read() returns or poll() reports POLLIN. It is kept per open file,
+ * must be a multiple of 4 and at most daqdrv_ring_ctrl.size. A read() asking
+ * for less than the watermark returns as soon as its request can be filled.
+ *
+ * Any number of processes can read at the same time, each open file gets all
+ * the data captured after it was opened. A reader that falls more than the
+ * ring size behind skips to the oldest data still in the ring.
+ * DAQDRV_IOC_GET_OVERRUNS returns how often that happened to this open file
+ * and how many bytes it lost.
+ */
+#define DAQDRV_IOC_MAGIC 0xDA
+
+#define DAQDRV_IOC_SET_WATERMARK _IOW(DAQDRV_IOC_MAGIC, 0x01, __u32)
+#define DAQDRV_IOC_GET_WATERMARK _IOR(DAQDRV_IOC_MAGIC, 0x02, __u32)
+
+struct daqdrv_overruns {
+	__u64 count;
+	__u64 bytes;
+};
+
+#define DAQDRV_IOC_GET_OVERRUNS _IOR(DAQDRV_IOC_MAGIC, 0x03, struct daqdrv_overruns)
+
+/*
+ * Control of the acquisition, version DAQDRV_IOC_VERSION.
+ *
+ * DAQDRV_IOC_GET_VERSION returns the version of this set of commands, it is
+ * increased whenever one of them or one of the structures changes.
+ *
+ * The first open() starts the acquisition and the last close() stops it.
+ * DAQDRV_IOC_STOP and DAQDRV_IOC_START stop and resume it in between for all
+ * readers, their positions in the ring are kept. DAQDRV_IOC_CLEAR drops what
+ * the FPGA has buffered.
+ *
+ * DAQDRV_IOC_SET_RATE takes a sample rate in Hz and returns the rate that was
+ * actually achieved. A running acquisition switches over without stopping:
+ * the samples the FPGA buffered at the old rate are dropped, the first block
+ * at the new rate is flagged with DAQDRV_BLOCK_FLAG_RATE_CHANGE and
+ * daqdrv_ring_ctrl.rate_pos moves to it. Other readers keep their positions,
+ * the calling open file skips to the new rate. rate_change_at in
+ * daqdrv_status tells a reader how many bytes it still has at the old rate.
+ *
+ * DAQDRV_IOC_SET_SEGMENTS splits the FPGA buffer into a power of 2 segments
+ * and makes the FPGA interrupt for each of them, so blocks get smaller and
+ * reach the readers sooner. It returns the number that was set, which is at
+ * most what the bitstream supports (1 unless daqdrv was loaded with
+ * fpga_max_segments). It applies to all readers, so a change fails with EBUSY
+ * unless the calling file is the only one open. The FPGA buffer and the ring
+ * are dropped, as all blocks in the ring must be of one size.
+ * daqdrv_ring_ctrl.block_size and the length in the block headers follow it.
+ * Every open starts with the segments the device had before, a reader that
+ * cares sets them right after open().
+ *
+ * DAQDRV_IOC_DAC_LOOP takes the next length bytes, a multiple of 4 and at
+ * most one FPGA buffer, off the output ring and makes the FPGA play them over
+ * and over without the driver refilling anything. They must already be in
+ * the ring. A length of 0 goes back to playing the ring. The output is
+ * undefined for up to one FPGA buffer after either switch. Without a DAC
+ * buffer in the FPGA design, write() and this fail with EOPNOTSUPP.
+ *
+ * DAQDRV_IOC_GET_STATUS and DAQDRV_IOC_GET_STATS return struct daqdrv_status
+ * and struct daqdrv_statistics. fill in daqdrv_status is for the calling open
+ * file, the statistics are the ones in /sys/kernel/daqdrvN/statistics.
+ */
+#define DAQDRV_IOC_VERSION 5
+
+#define DAQDRV_STATUS_RUNNING    (1u << 0)
+#define DAQDRV_STATUS_CLK_LOCKED (1u << 1)
+#define DAQDRV_STATUS_DAC        (1u << 2) /* the FPGA design has a DAC buffer */
+#define DAQDRV_STATUS_DAC_LOOP   (1u << 3)
+
+struct daqdrv_status {
+	__u32 version;		/* DAQDRV_IOC_VERSION */
+	__u32 flags;		/* DAQDRV_STATUS_* */
+	__u32 sample_rate_hz;
+	__u32 fill;		/* bytes this open file can read right now */
+	__u32 ring_size;
+	__u32 readers;		/* open files of the device */
+	__u32 rate_change_at;	/* bytes before the last rate change, 0 if it was passed */
+	__u32 segments;		/* interrupts per FPGA buffer */
+	__u32 dac_fill;		/* bytes in the output ring */
+	__u32 dac_loop_len;	/* bytes of the looped waveform, 0 unless looping */
+};
+
+struct daqdrv_statistics {
+	__u64 irqs;
+	__u64 blocks_accepted;
+	__u64 blocks_dropped;
+	__u64 overwrites;
+	__u64 bytes_read;
+	__u64 reader_overruns;
+	__u32 peak_fill;
+	__u32 irq_service_max_ns;
+	__u64 dac_underruns;
+};
+
+#define DAQDRV_IOC_GET_VERSION _IOR(DAQDRV_IOC_MAGIC, 0x04, __u32)
+#define DAQDRV_IOC_SET_RATE    _IOWR(DAQDRV_IOC_MAGIC, 0x05, __u32)
+#define DAQDRV_IOC_START       _IO(DAQDRV_IOC_MAGIC, 0x06)
+#define DAQDRV_IOC_STOP        _IO(DAQDRV_IOC_MAGIC, 0x07)
+#define DAQDRV_IOC_CLEAR       _IO(DAQDRV_IOC_MAGIC, 0x08)
+#define DAQDRV_IOC_GET_STATUS  _IOR(DAQDRV_IOC_MAGIC, 0x09, struct daqdrv_status)
+#define DAQDRV_IOC_GET_STATS   _IOR(DAQDRV_IOC_MAGIC, 0x0A, struct daqdrv_statistics)
+#define DAQDRV_IOC_SET_SEGMENTS _IOWR(DAQDRV_IOC_MAGIC, 0x0B, __u32)
+#define DAQDRV_IOC_DAC_LOOP    _IOW(DAQDRV_IOC_MAGIC, 0x0C, __u32)
+
+#define DAQDRV_WATERMARK_DEFAULT 4
+
+#endif
@@ -13,6 +13,8 @@
 #include <linux/log2.h>
 #include <linux/uaccess.h>
 #include <linux/io.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 #include "kfifo-iomod.h"
 
 /*
@@ -42,7 +44,11 @@ int __kfifo_iomod_alloc(struct __kfifo_iomod *fifo, unsigned int size,
 		return -EINVAL;
 	}
 
-	fifo->data = kmalloc_array(esize, size, gfp_mask);
+	/*
+	 * vmalloc, so the fifo can be large and still be mapped into
+	 * userspace with remap_vmalloc_range()
+	 */
+	fifo->data = vmalloc_user(array_size(esize, size));
 
 	if (!fifo->data) {
 		fifo->mask = 0;
@@ -56,7 +62,7 @@ EXPORT_SYMBOL(__kfifo_iomod_alloc);
 
 void __kfifo_iomod_free(struct __kfifo_iomod *fifo)
 {
-	kfree(fifo->data);
+	vfree(fifo->data);
 	fifo->in = 0;
 	fifo->out = 0;
 	fifo->esize = 0;
@@ -88,8 +94,13 @@ int __kfifo_iomod_init(struct __kfifo_iomod *fifo, void *buffer,
 }
 EXPORT_SYMBOL(__kfifo_iomod_init);
 
+static void kfifo_iomod_memcpy_fromio(void *dst, const void __iomem *src, size_t len)
+{
+	memcpy_fromio(dst, src, len);
+}
+
 static void kfifo_iomod_copy_in(struct __kfifo_iomod *fifo, const void *src,
-		unsigned int len, unsigned int off)
+		unsigned int len, unsigned int off, kfifo_iomod_copy_t copy)
 {
 	unsigned int size = fifo->mask + 1;
 	unsigned int esize = fifo->esize;
@@ -106,12 +117,12 @@ static void kfifo_iomod_copy_in(struct __kfifo_iomod *fifo, const void *src,
 	if ((l % 4) != 0 || (((unsigned int)src) % 4) != 0) {
 		printk("error: first read start %08x, len %d\n", (unsigned int)src, l);
 	} else {
-		memcpy_fromio(fifo->data + off, src, l);
+		copy(fifo->data + off, (const void __iomem *)src, l);
 	}
 	if ((len - l) % 4 != 0 || (((unsigned int)src + l) % 4) != 0) {
 		printk("error: second read start %08x, len %d\n", (unsigned int)src + l, len - l);
 	} else {
-		memcpy_fromio(fifo->data, src + l, len - l);
+		copy(fifo->data, (const void __iomem *)(src + l), len - l);
 	}
 	
 	/*
@@ -121,6 +132,33 @@ static void kfifo_iomod_copy_in(struct __kfifo_iomod *fifo, const void *src,
 	smp_wmb();
 }
 
+/*
+ * like kfifo_iomod_copy_in, but the source is regular kernel memory
+ */
+static void kfifo_iomod_copy_in_mem(struct __kfifo_iomod *fifo, const void *src,
+		unsigned int len, unsigned int off)
+{
+	unsigned int size = fifo->mask + 1;
+	unsigned int esize = fifo->esize;
+	unsigned int l;
+
+	off &= fifo->mask;
+	if (esize != 1) {
+		off *= esize;
+		size *= esize;
+		len *= esize;
+	}
+	l = min(len, size - off);
+
+	memcpy(fifo->data + off, src, l);
+	memcpy(fifo->data, src + l, len - l);
+	/*
+	 * make sure that the data in the fifo is up to date before
+	 * incrementing the fifo->in index counter
+	 */
+	smp_wmb();
+}
+
 unsigned int __kfifo_iomod_in(struct __kfifo_iomod *fifo,
 		const void *buf, unsigned int len)
 {
@@ -130,12 +168,35 @@ unsigned int __kfifo_iomod_in(struct __kfifo_iomod *fifo,
 	if (len > l)
 		len = l;
 
-	kfifo_iomod_copy_in(fifo, buf, len, fifo->in);
+	kfifo_iomod_copy_in(fifo, buf, len, fifo->in, kfifo_iomod_memcpy_fromio);
 	fifo->in += len;
 	return len;
 }
 EXPORT_SYMBOL(__kfifo_iomod_in);
 
+unsigned int __kfifo_iomod_in_at_copy(struct __kfifo_iomod *fifo,
+		const void *buf, unsigned int len, unsigned int off,
+		kfifo_iomod_copy_t copy)
+{
+	if (off + len > kfifo_iomod_unused(fifo))
+		return 0;
+
+	kfifo_iomod_copy_in(fifo, buf, len, fifo->in + off, copy);
+	return len;
+}
+EXPORT_SYMBOL(__kfifo_iomod_in_at_copy);
+
+unsigned int __kfifo_iomod_in_mem_at(struct __kfifo_iomod *fifo,
+		const void *buf, unsigned int len, unsigned int off)
+{
+	if (off + len > kfifo_iomod_unused(fifo))
+		return 0;
+
+	kfifo_iomod_copy_in_mem(fifo, buf, len, fifo->in + off);
+	return len;
+}
+EXPORT_SYMBOL(__kfifo_iomod_in_mem_at);
+
 static void kfifo_iomod_copy_out(struct __kfifo_iomod *fifo, void *dst,
 		unsigned int len, unsigned int off)
 {
@@ -303,6 +364,55 @@ int __kfifo_iomod_to_user(struct __kfifo_iomod *fifo, void __user *to,
 }
 EXPORT_SYMBOL(__kfifo_iomod_to_user);
 
+static unsigned int kfifo_iomod_copy_to_iter(struct __kfifo_iomod *fifo,
+		struct iov_iter *to, unsigned int len, unsigned int off)
+{
+	unsigned int l;
+	size_t n;
+	unsigned int size = fifo->mask + 1;
+	unsigned int esize = fifo->esize;
+
+	off &= fifo->mask;
+	if (esize != 1) {
+		off *= esize;
+		size *= esize;
+		len *= esize;
+	}
+	l = min(len, size - off);
+
+	n = copy_to_iter(fifo->data + off, l, to);
+	if (n == l)
+		n += copy_to_iter(fifo->data, len - l, to);
+	/* return the number of bytes copied */
+	return n;
+}
+
+int __kfifo_iomod_to_iter_at(struct __kfifo_iomod *fifo, struct iov_iter *to,
+		unsigned long len, unsigned int off, unsigned int *copied)
+{
+	unsigned int l;
+	unsigned int esize = fifo->esize;
+
+	if (esize != 1)
+		len /= esize;
+
+	l = fifo->in - off;
+	if (len > l)
+		len = l;
+	*copied = kfifo_iomod_copy_to_iter(fifo, to, len, off);
+	if (unlikely(*copied != len * esize))
+		return -EFAULT;
+	return 0;
+}
+EXPORT_SYMBOL(__kfifo_iomod_to_iter_at);
+
+static struct page *kfifo_iomod_buf_to_page(void *buf)
+{
+	if (is_vmalloc_addr(buf))
+		return vmalloc_to_page(buf);
+	return virt_to_page(buf);
+}
+
 static int setup_sgl_buf(struct scatterlist *sgl, void *buf,
 		int nents, unsigned int len)
 {
@@ -318,16 +428,16 @@ static int setup_sgl_buf(struct scatterlist *sgl, void *buf,
 		return 0;
 
 	n = 0;
-	page = virt_to_page(buf);
+	page = kfifo_iomod_buf_to_page(buf);
 	off = offset_in_page(buf);
 	l = 0;
 
-	while (len >= l + PAGE_SIZE - off) {
+	while (len > l + PAGE_SIZE - off) {
 		struct page *npage;
 
 		l += PAGE_SIZE;
 		buf += PAGE_SIZE;
-		npage = virt_to_page(buf);
+		npage = kfifo_iomod_buf_to_page(buf);
 		if (page_to_phys(page) != page_to_phys(npage) - l) {
 			sg_set_page(sgl, page, l - off, off);
 			sgl = sg_next(sgl);
@@ -377,6 +487,16 @@ unsigned int __kfifo_iomod_dma_in_prepare(struct __kfifo_iomod *fifo,
 }
 EXPORT_SYMBOL(__kfifo_iomod_dma_in_prepare);
 
+unsigned int __kfifo_iomod_dma_in_prepare_at(struct __kfifo_iomod *fifo,
+		struct scatterlist *sgl, int nents, unsigned int len, unsigned int off)
+{
+	if (off + len > kfifo_iomod_unused(fifo))
+		return 0;
+
+	return setup_sgl(fifo, sgl, nents, len, fifo->in + off);
+}
+EXPORT_SYMBOL(__kfifo_iomod_dma_in_prepare_at);
+
 unsigned int __kfifo_iomod_dma_out_prepare(struct __kfifo_iomod *fifo,
 		struct scatterlist *sgl, int nents, unsigned int len)
 {
@@ -454,7 +574,7 @@ unsigned int __kfifo_iomod_in_r(struct __kfifo_iomod *fifo, const void *buf,
 
 	__kfifo_iomod_poke_n(fifo, len, recsize);
 
-	kfifo_iomod_copy_in(fifo, buf, len, fifo->in + recsize);
+	kfifo_iomod_copy_in(fifo, buf, len, fifo->in + recsize, kfifo_iomod_memcpy_fromio);
 	fifo->in += len + recsize;
 	return len;
 }
@@ -41,6 +41,7 @@
 #include <linux/spinlock.h>
 #include <linux/stddef.h>
 #include <linux/scatterlist.h>
+#include <linux/uio.h>
 
 struct __kfifo_iomod {
 	unsigned int	in;
@@ -50,6 +51,11 @@ struct __kfifo_iomod {
 	void		*data;
 };
 
+/*
+ * copies @len bytes of iomem into the fifo, for kfifo_iomod_in_at_copy()
+ */
+typedef void (*kfifo_iomod_copy_t)(void *dst, const void __iomem *src, size_t len);
+
 #define __STRUCT_KFIFO_IOMOD_COMMON(datatype, recsize, ptrtype) \
 	union { \
 		struct __kfifo_iomod	kfifo_iomod; \
@@ -340,9 +346,11 @@ __kfifo_iomod_uint_must_check_helper( \
  * kfifo_iomod_alloc - dynamically allocates a new fifo buffer
  * @fifo: pointer to the fifo
  * @size: the number of elements in the fifo, this must be a power of 2
- * @gfp_mask: get_free_pages mask, passed to kmalloc()
+ * @gfp_mask: unused, the buffer always comes from vmalloc_user()
  *
- * This macro dynamically allocates a new fifo buffer.
+ * This macro dynamically allocates a new fifo buffer. The buffer is
+ * virtually contiguous only and can be mapped into userspace with
+ * remap_vmalloc_range().
  *
  * The number of elements will be rounded-up to a power of 2.
  * The fifo will be release with kfifo_iomod_free().
@@ -529,6 +537,68 @@ __kfifo_iomod_uint_must_check_helper( \
 	__kfifo_iomod_in(__kfifo_iomod, __buf, __n); \
 })
 
+/**
+ * kfifo_iomod_in_at_copy - put data into the fifo without making it visible
+ * @fifo: address of the fifo to be used
+ * @buf: the data to be added
+ * @n: number of elements to be added
+ * @off: offset in elements from the current in counter
+ * @copy: kfifo_iomod_copy_t that moves the data, called once or twice
+ *
+ * This macro copies the given buffer into the unused part of the fifo with
+ * @copy, starting @off elements after the in counter, which is not changed.
+ * The data becomes visible with kfifo_iomod_in_commit(). Together with
+ * kfifo_iomod_in_mem_at() it allows a writer to fill in a header after
+ * the data it describes. It returns @n, or 0 if @off + @n elements don't fit.
+ *
+ * Note that with only one concurrent reader and one concurrent
+ * writer, you don't need extra locking to use these macro.
+ */
+#define	kfifo_iomod_in_at_copy(fifo, buf, n, off, copy) \
+({ \
+	typeof((fifo) + 1) __tmp = (fifo); \
+	typeof(__tmp->ptr_const) __buf = (buf); \
+	struct __kfifo_iomod *__kfifo_iomod = &__tmp->kfifo_iomod; \
+	__kfifo_iomod_in_at_copy(__kfifo_iomod, __buf, n, off, copy); \
+})
+
+/**
+ * kfifo_iomod_in_mem_at - put regular memory into the fifo without making
+ * it visible
+ * @fifo: address of the fifo to be used
+ * @buf: the data to be added, in regular memory
+ * @n: number of elements to be added
+ * @off: offset in elements from the current in counter
+ *
+ * Same as kfifo_iomod_in_at_copy(), but @buf is not iomem and is copied
+ * with memcpy().
+ */
+#define	kfifo_iomod_in_mem_at(fifo, buf, n, off) \
+({ \
+	typeof((fifo) + 1) __tmp = (fifo); \
+	typeof(__tmp->ptr_const) __buf = (buf); \
+	struct __kfifo_iomod *__kfifo_iomod = &__tmp->kfifo_iomod; \
+	__kfifo_iomod_in_mem_at(__kfifo_iomod, __buf, n, off); \
+})
+
+/**
+ * kfifo_iomod_in_commit - make data added with the _at variants visible
+ * @fifo: address of the fifo to be used
+ * @n: number of elements to commit
+ *
+ * This macro advances the in counter by @n. No error checking will be done.
+ *
+ * Note that with only one concurrent reader and one concurrent
+ * writer, you don't need extra locking to use these macro.
+ */
+#define	kfifo_iomod_in_commit(fifo, n) \
+(void)({ \
+	typeof((fifo) + 1) __tmp = (fifo); \
+	struct __kfifo_iomod *__kfifo_iomod = &__tmp->kfifo_iomod; \
+	smp_wmb(); \
+	__kfifo_iomod->in += (n); \
+})
+
 /**
  * kfifo_iomod_in_spinlocked - put data into the fifo using a spinlock for locking
  * @fifo: address of the fifo to be used
@@ -703,6 +773,33 @@ __kfifo_iomod_int_must_check_helper( \
 }) \
 )
 
+/**
+ * kfifo_iomod_to_iter_at - copies data from any position of the fifo into
+ * an iov_iter
+ * @fifo: address of the fifo to be used
+ * @to: where the data must be copied
+ * @len: the maximum number of bytes to copy
+ * @off: in/out counter value of the first element to copy
+ * @copied: pointer to output variable to store the number of copied bytes
+ *
+ * This macro copies at most @len bytes between @off and the in counter into
+ * @to and returns -EFAULT/0. The out counter is not changed, so any number
+ * of readers can keep their own position. It's up to the caller to make
+ * sure the copied data was not overwritten in the meantime.
+ * Not usable with record fifos.
+ */
+#define	kfifo_iomod_to_iter_at(fifo, to, len, off, copied) \
+__kfifo_iomod_int_must_check_helper( \
+({ \
+	typeof((fifo) + 1) __tmp = (fifo); \
+	struct iov_iter *__to = (to); \
+	unsigned int __len = (len); \
+	unsigned int *__copied = (copied); \
+	struct __kfifo_iomod *__kfifo_iomod = &__tmp->kfifo_iomod; \
+	__kfifo_iomod_to_iter_at(__kfifo_iomod, __to, __len, off, __copied); \
+}) \
+)
+
 /**
  * kfifo_iomod_dma_in_prepare - setup a scatterlist for DMA input
  * @fifo: address of the fifo to be used
@@ -729,6 +826,30 @@ __kfifo_iomod_int_must_check_helper( \
 	__kfifo_iomod_dma_in_prepare(__kfifo_iomod, __sgl, __nents, __len); \
 })
 
+/**
+ * kfifo_iomod_dma_in_prepare_at - setup a scatterlist for DMA input at an
+ * offset from the in counter
+ * @fifo: address of the fifo to be used
+ * @sgl: pointer to the scatterlist array
+ * @nents: number of entries in the scatterlist array
+ * @len: number of elements to transfer
+ * @off: offset in elements from the current in counter
+ *
+ * Same as kfifo_iomod_dma_in_prepare(), but the transfer starts @off
+ * elements after the in counter, leaving room for a header that is added
+ * with kfifo_iomod_in_mem_at(). It returns the number entries in the
+ * scatterlist array, or 0 if @off + @len elements don't fit.
+ *
+ * Note that with only one concurrent reader and one concurrent
+ * writer, you don't need extra locking to use these macros.
+ */
+#define	kfifo_iomod_dma_in_prepare_at(fifo, sgl, nents, len, off) \
+({ \
+	typeof((fifo) + 1) __tmp = (fifo); \
+	struct __kfifo_iomod *__kfifo_iomod = &__tmp->kfifo_iomod; \
+	__kfifo_iomod_dma_in_prepare_at(__kfifo_iomod, sgl, nents, len, off); \
+})
+
 /**
  * kfifo_iomod_dma_in_finish - finish a DMA IN operation
  * @fifo: address of the fifo to be used
@@ -840,6 +961,13 @@ extern int __kfifo_iomod_init(struct __kfifo_iomod *fifo, void *buffer,
 extern unsigned int __kfifo_iomod_in(struct __kfifo_iomod *fifo,
 	const void *buf, unsigned int len);
 
+extern unsigned int __kfifo_iomod_in_at_copy(struct __kfifo_iomod *fifo,
+	const void *buf, unsigned int len, unsigned int off,
+	kfifo_iomod_copy_t copy);
+
+extern unsigned int __kfifo_iomod_in_mem_at(struct __kfifo_iomod *fifo,
+	const void *buf, unsigned int len, unsigned int off);
+
 extern unsigned int __kfifo_iomod_out(struct __kfifo_iomod *fifo,
 	void *buf, unsigned int len);
 
@@ -849,9 +977,16 @@ extern int __kfifo_iomod_from_user(struct __kfifo_iomod *fifo,
 extern int __kfifo_iomod_to_user(struct __kfifo_iomod *fifo,
 	void __user *to, unsigned long len, unsigned int *copied);
 
+extern int __kfifo_iomod_to_iter_at(struct __kfifo_iomod *fifo,
+	struct iov_iter *to, unsigned long len, unsigned int off,
+	unsigned int *copied);
+
 extern unsigned int __kfifo_iomod_dma_in_prepare(struct __kfifo_iomod *fifo,
 	struct scatterlist *sgl, int nents, unsigned int len);
 
+extern unsigned int __kfifo_iomod_dma_in_prepare_at(struct __kfifo_iomod *fifo,
+	struct scatterlist *sgl, int nents, unsigned int len, unsigned int off);
+
 extern unsigned int __kfifo_iomod_dma_out_prepare(struct __kfifo_iomod *fifo,
 	struct scatterlist *sgl, int nents, unsigned int len);
 